@@ -0,0 +1,869 @@
+/*
+ * RSFS - Really Simple File System
+ *
+ * Copyright © 2010 Gustavo Maciel Dias Vieira
+ * Copyright © 2010 Rodrigo Rocco Barbieri
+ *
+ * Conjunto de cargas repetíveis sobre a API de fs.h: criação e remoção de
+ * arquivos, fs_write com requisições pequenas e grandes, leitura
+ * sequencial, leitura logo depois da escrita pelo mesmo descritor FS_RW,
+ * fs_free/fs_list, várias threads, cada uma no seu arquivo ou todas lendo
+ * o mesmo por descritores próprios, importação em massa numa imagem quase
+ * cheia e montagem (fs_init) de imagens de vários tamanhos, com a memória
+ * residente. Cada carga começa numa imagem recém formatada e sai como uma
+ * linha separada por tabulações, com operações por segundo, MB/s e
+ * percentis da latência de cada operação.
+ *
+ * This file is part of RSFS.
+ *
+ * RSFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+
+#define BENCH_IMAGE "/tmp/rsfs-bench.img"
+#define BENCH_IMAGE_MB 128
+#define BENCH_TOTAL (32 * 1024 * 1024)
+#define BENCH_OPS_MAX (1024 * 1024)  /* limita o fluxo das requisições pequenas */
+
+/* criação e remoção: arquivos por rodada e rodadas */
+#define BENCH_CHURN_FILES 500
+#define BENCH_CHURN_ROUNDS 4
+
+/* consultas: chamadas de fs_free e de fs_list, esta com BENCH_CHURN_FILES arquivos */
+#define BENCH_FREE_CALLS 10000
+#define BENCH_LIST_CALLS 200
+#define BENCH_LIST_BUFFER (64 * 1024)
+
+/* leitura logo depois da escrita pelo mesmo descritor FS_RW */
+#define BENCH_RW_REQ 3000
+#define BENCH_RW_LOTE 8
+#define BENCH_RW_OPS 2000
+
+/* carga concorrente: bytes por thread, tamanho das requisições e releituras */
+#define BENCH_THREADS_MAX 8
+#define BENCH_THREAD_TOTAL (8 * 1024 * 1024)
+#define BENCH_THREAD_REQ (64 * 1024)
+#define BENCH_THREAD_PASSES 4
+
+/* importação em massa: arquivos do host, de tamanhos que não fecham clusters */
+#define BENCH_IMPORT_FILES 64
+#define BENCH_IMPORT_UNIT 37000
+#define BENCH_IMPORT_HOLE 8  /* clusters de cada buraco do espaço livre */
+
+/* montagem: imagem povoada com alguns arquivos e montada várias vezes */
+#define BENCH_MOUNT_IMAGE "/tmp/rsfs-mount.img"
+#define BENCH_MOUNT_FILES 64
+#define BENCH_MOUNT_FILE_SIZE (64 * 1024)
+#define BENCH_MOUNTS 50
+
+double agora() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double mbps(long bytes, double segundos) {
+  return segundos > 0 ? bytes / (1024.0 * 1024.0) / segundos : 0;
+}
+
+/*
+ * Medidas de uma carga: a latência de cada operação, os bytes transferidos
+ * e o tempo de relógio somado dos trechos entre medida_abre e medida_fecha.
+ */
+typedef struct {
+  double *lat;
+  long n;
+  long cap;
+  long bytes;
+  double segundos;
+  double aberta;
+} medida;
+
+void medida_inicia(medida *m) {
+  memset(m, 0, sizeof(*m));
+}
+
+void medida_abre(medida *m) {
+  m->aberta = agora();
+}
+
+void medida_fecha(medida *m) {
+  m->segundos += agora() - m->aberta;
+}
+
+/* registra uma operação que começou em inicio e transferiu bytes */
+void medida_op(medida *m, double inicio, long bytes) {
+  double lat = agora() - inicio;
+
+  if (m->n == m->cap) {
+    long cap = m->cap ? m->cap * 2 : 1024;
+    double *novo = realloc(m->lat, sizeof(double) * cap);
+    if (novo == NULL) {
+      return;
+    }
+    m->lat = novo;
+    m->cap = cap;
+  }
+  m->lat[m->n++] = lat;
+  m->bytes += bytes;
+}
+
+/* acrescenta a m as operações de outra, que é liberada */
+void medida_junta(medida *m, medida *outra) {
+  for (long i = 0; i < outra->n; i++) {
+    if (m->n == m->cap) {
+      long cap = m->cap ? m->cap * 2 : 1024;
+      double *novo = realloc(m->lat, sizeof(double) * cap);
+      if (novo == NULL) {
+        break;
+      }
+      m->lat = novo;
+      m->cap = cap;
+    }
+    m->lat[m->n++] = outra->lat[i];
+  }
+  m->bytes += outra->bytes;
+  free(outra->lat);
+  outra->lat = NULL;
+}
+
+int compara_lat(const void *a, const void *b) {
+  double x = *(double *) a, y = *(double *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* percentil p (pelo posto mais próximo) da latência, em microssegundos */
+double percentil(medida *m, int p) {
+  if (m->n == 0) {
+    return 0;
+  }
+  long i = (m->n * p + 99) / 100 - 1;
+  return m->lat[i < 0 ? 0 : i] * 1e6;
+}
+
+void cabecalho() {
+  printf("carga\tops\tsegundos\tops_s\tmb_s\tp50_us\tp90_us\tp99_us\tmax_us\tok\n");
+}
+
+/* imprime a linha da carga e libera as medidas */
+void relata(char *carga, medida *m, int ok) {
+  qsort(m->lat, m->n, sizeof(double), compara_lat);
+  printf("%s\t%ld\t%.6f\t%.1f\t%.2f\t%.2f\t%.2f\t%.2f\t%.2f\t%s\n", carga, m->n, m->segundos,
+         m->segundos > 0 ? m->n / m->segundos : 0, mbps(m->bytes, m->segundos),
+         percentil(m, 50), percentil(m, 90), percentil(m, 99), percentil(m, 100), ok ? "ok" : "ERRO");
+  fflush(stdout);
+  free(m->lat);
+  m->lat = NULL;
+}
+
+/* cada carga parte de uma imagem recém formatada */
+int fresca() {
+  return fs_format();
+}
+
+/* cria e remove BENCH_CHURN_FILES arquivos, BENCH_CHURN_ROUNDS vezes */
+int bench_churn() {
+  medida cria, remove;
+  int ok = fresca();
+  long long livre = -1;
+  char nome[16];
+
+  medida_inicia(&cria);
+  medida_inicia(&remove);
+  for (int r = 0; ok && r < BENCH_CHURN_ROUNDS; r++) {
+    medida_abre(&cria);
+    for (int i = 0; i < BENCH_CHURN_FILES; i++) {
+      sprintf(nome, "c%d", i);
+      double inicio = agora();
+      ok &= fs_create(nome);
+      medida_op(&cria, inicio, 0);
+    }
+    medida_fecha(&cria);
+    medida_abre(&remove);
+    for (int i = 0; i < BENCH_CHURN_FILES; i++) {
+      sprintf(nome, "c%d", i);
+      double inicio = agora();
+      ok &= fs_remove(nome);
+      medida_op(&remove, inicio, 0);
+    }
+    medida_fecha(&remove);
+    //o diretório cresce na primeira rodada e fica; depois nenhum cluster pode vazar
+    if (livre == -1) {
+      livre = fs_free();
+    }
+    ok &= fs_free() == livre;
+  }
+  relata("criar", &cria, ok);
+  relata("remover", &remove, ok);
+  return ok;
+}
+
+/* conteúdo do byte i de cada requisição */
+char padrao_req(int i) {
+  return (char) (i * 7 + 1);
+}
+
+/*
+ * Escreve um fluxo de requisições de tam bytes e o relê com requisições do
+ * mesmo tamanho. O fs_close entra no tempo da escrita, que só termina
+ * quando o último cluster é gravado.
+ */
+int bench_rw(int tam) {
+  char *buffer = malloc(tam);
+  long total = (long) tam * BENCH_OPS_MAX < BENCH_TOTAL ? (long) tam * BENCH_OPS_MAX : BENCH_TOTAL;
+  long escrito = 0, lido = 0;
+  medida escrita, leitura;
+  char carga[32];
+  int fd, n;
+  int ok = buffer != NULL && fresca();
+
+  if (!ok || !fs_create("bench") || (fd = fs_open("bench", FS_W)) == -1) {
+    free(buffer);
+    return 0;
+  }
+  for (int i = 0; i < tam; i++) {
+    buffer[i] = padrao_req(i);
+  }
+  medida_inicia(&escrita);
+  medida_abre(&escrita);
+  while (escrito < total) {
+    double inicio = agora();
+    if (fs_write(buffer, tam, fd) != tam) {
+      ok = 0;
+      break;
+    }
+    medida_op(&escrita, inicio, tam);
+    escrito += tam;
+  }
+  fs_close(fd);
+  medida_fecha(&escrita);
+  sprintf(carga, "escrita_%d", tam);
+  relata(carga, &escrita, ok);
+
+  if ((fd = fs_open("bench", FS_R)) == -1) {
+    free(buffer);
+    return 0;
+  }
+  memset(buffer, 0, tam);
+  medida_inicia(&leitura);
+  medida_abre(&leitura);
+  for (;;) {
+    double inicio = agora();
+    if ((n = fs_read(buffer, tam, fd)) <= 0) {
+      break;
+    }
+    medida_op(&leitura, inicio, n);
+    //confere só as pontas de cada requisição para não dominar o tempo
+    if (buffer[0] != padrao_req(0) || buffer[n - 1] != padrao_req(n - 1)) {
+      ok = 0;
+    }
+    lido += n;
+  }
+  fs_close(fd);
+  medida_fecha(&leitura);
+  fs_remove("bench");
+  sprintf(carga, "leitura_%d", tam);
+  relata(carga, &leitura, ok && lido == escrito);
+
+  free(buffer);
+  return ok && lido == escrito;
+}
+
+/* conteúdo esperado do byte i do arquivo id (nas cargas concorrentes, o da thread id) */
+char padrao(int id, long i) {
+  return (char) (i * 31 + id * 7 + (i >> 12));
+}
+
+/*
+ * Acrescenta pelo mesmo descritor FS_RW lotes de BENCH_RW_LOTE requisições
+ * de BENCH_RW_REQ bytes, que ficam no buffer de escrita ocupando vários
+ * clusters, e relê cada uma com fs_pread. No fim relê o arquivo inteiro
+ * com fs_read pelo mesmo descritor.
+ */
+int bench_rw_mesmo_descritor() {
+  char *buffer = malloc(BENCH_RW_REQ);
+  char *lido = malloc(BENCH_RW_REQ);
+  medida m;
+  long long escrito = 0;
+  int fd = -1, n;
+  int ok = buffer != NULL && lido != NULL && fresca() && fs_create("rw")
+           && (fd = fs_open("rw", FS_RW)) != -1;
+
+  medida_inicia(&m);
+  medida_abre(&m);
+  for (int r = 0; ok && r < BENCH_RW_OPS / BENCH_RW_LOTE; r++) {
+    long long lote = escrito;
+    for (int k = 0; ok && k < BENCH_RW_LOTE; k++) {
+      for (int i = 0; i < BENCH_RW_REQ; i++) {
+        buffer[i] = padrao(0, escrito + i);
+      }
+      ok = fs_write(buffer, BENCH_RW_REQ, fd) == BENCH_RW_REQ;
+      escrito += BENCH_RW_REQ;
+    }
+    for (long long pos = lote; ok && pos < escrito; pos += BENCH_RW_REQ) {
+      double inicio = agora();
+      ok = fs_pread(lido, BENCH_RW_REQ, pos, fd) == BENCH_RW_REQ;
+      medida_op(&m, inicio, BENCH_RW_REQ);
+      for (int i = 0; i < BENCH_RW_REQ; i++) {
+        ok &= lido[i] == padrao(0, pos + i);
+      }
+    }
+  }
+  medida_fecha(&m);
+  ok &= fs_seek(0, FS_SEEK_SET, fd) == 0;
+  for (long long pos = 0; ok && pos < escrito; pos += n) {
+    if ((n = fs_read(lido, BENCH_RW_REQ, fd)) <= 0) {
+      ok = 0;
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      ok &= lido[i] == padrao(0, pos + i);
+    }
+  }
+  if (fd != -1) {
+    fs_close(fd);
+  }
+  fs_remove("rw");
+  relata("rw_mesmo_desc", &m, ok);
+  free(buffer);
+  free(lido);
+  return ok;
+}
+
+/* fs_free numa imagem vazia e fs_list com BENCH_CHURN_FILES arquivos */
+int bench_consultas() {
+  char *buffer = malloc(BENCH_LIST_BUFFER);
+  medida livre, lista;
+  char nome[16];
+  int ok = buffer != NULL && fresca();
+
+  medida_inicia(&livre);
+  medida_abre(&livre);
+  for (int i = 0; ok && i < BENCH_FREE_CALLS; i++) {
+    double inicio = agora();
+    ok &= fs_free() > 0;
+    medida_op(&livre, inicio, 0);
+  }
+  medida_fecha(&livre);
+  relata("free", &livre, ok);
+
+  for (int i = 0; ok && i < BENCH_CHURN_FILES; i++) {
+    sprintf(nome, "l%d", i);
+    ok &= fs_create(nome);
+  }
+  medida_inicia(&lista);
+  medida_abre(&lista);
+  for (int i = 0; ok && i < BENCH_LIST_CALLS; i++) {
+    double inicio = agora();
+    ok &= fs_list(buffer, BENCH_LIST_BUFFER);
+    medida_op(&lista, inicio, strlen(buffer));
+  }
+  medida_fecha(&lista);
+  relata("list", &lista, ok);
+  free(buffer);
+  return ok;
+}
+
+typedef struct {
+  int id;
+  int ok;
+  medida m;
+} tarefa;
+
+/* escreve o arquivo da thread e cria/remove arquivos temporários no meio */
+void *escreve_thread(void *arg) {
+  tarefa *t = arg;
+  char *buffer = malloc(BENCH_THREAD_REQ);
+  char nome[16], temp[16];
+  int fd = -1;
+
+  sprintf(nome, "th%d", t->id);
+  sprintf(temp, "tmp%d", t->id);
+  t->ok = buffer != NULL && fs_create(nome) && (fd = fs_open(nome, FS_W)) != -1;
+  for (long total = 0; t->ok && total < BENCH_THREAD_TOTAL; total += BENCH_THREAD_REQ) {
+    for (int i = 0; i < BENCH_THREAD_REQ; i++) {
+      buffer[i] = padrao(t->id, total + i);
+    }
+    double inicio = agora();
+    t->ok = fs_write(buffer, BENCH_THREAD_REQ, fd) == BENCH_THREAD_REQ;
+    medida_op(&t->m, inicio, BENCH_THREAD_REQ);
+    if (total % (1024 * 1024) == 0 && fs_create(temp)) {
+      int tfd = fs_open(temp, FS_W);
+      fs_write(buffer, 10000, tfd);
+      fs_close(tfd);
+      fs_remove(temp);
+    }
+  }
+  if (t->ok) {
+    fs_close(fd);
+  }
+  free(buffer);
+  return NULL;
+}
+
+/* relê o arquivo da thread id BENCH_THREAD_PASSES vezes conferindo cada byte */
+int le_conferindo(int id, medida *m) {
+  char *buffer = malloc(BENCH_THREAD_REQ);
+  char nome[16];
+  int fd, n;
+  int ok = buffer != NULL;
+
+  sprintf(nome, "th%d", id);
+  for (int passo = 0; ok && passo < BENCH_THREAD_PASSES; passo++) {
+    long lido = 0;
+    if ((fd = fs_open(nome, FS_R)) == -1) {
+      ok = 0;
+      break;
+    }
+    for (;;) {
+      double inicio = agora();
+      if ((n = fs_read(buffer, BENCH_THREAD_REQ, fd)) <= 0) {
+        break;
+      }
+      medida_op(m, inicio, n);
+      for (int i = 0; i < n; i++) {
+        if (buffer[i] != padrao(id, lido + i)) {
+          ok = 0;
+        }
+      }
+      lido += n;
+    }
+    fs_close(fd);
+    ok &= lido == BENCH_THREAD_TOTAL;
+  }
+  free(buffer);
+  return ok;
+}
+
+void *le_thread(void *arg) {
+  tarefa *t = arg;
+
+  t->ok = le_conferindo(t->id, &t->m);
+  return NULL;
+}
+
+/* todas as threads leem o arquivo da thread 0 ao mesmo tempo */
+void *le_quente_thread(void *arg) {
+  tarefa *t = arg;
+
+  t->ok = le_conferindo(0, &t->m);
+  return NULL;
+}
+
+/* MB/s de cada fase com uma thread, base da aceleração das outras */
+double mbps_uma_thread[3];
+
+/* núcleos em linha; com mais threads que isso a aceleração não diz nada */
+long nucleos = 1;
+
+/*
+ * Roda a fase f com n threads e relata as operações de todas juntas. Além
+ * dos dados que cada thread confere, todas precisam ter transferido os
+ * mesmos esperado bytes.
+ */
+int fase(char *carga, int f, int n, void *(*funcao)(void *), long esperado) {
+  pthread_t threads[BENCH_THREADS_MAX];
+  tarefa tarefas[BENCH_THREADS_MAX];
+  medida m;
+  int ok = 1;
+
+  medida_inicia(&m);
+  medida_abre(&m);
+  for (int i = 0; i < n; i++) {
+    tarefas[i].id = i;
+    medida_inicia(&tarefas[i].m);
+    pthread_create(&threads[i], NULL, funcao, &tarefas[i]);
+  }
+  for (int i = 0; i < n; i++) {
+    pthread_join(threads[i], NULL);
+    ok &= tarefas[i].ok;
+  }
+  medida_fecha(&m);
+  for (int i = 0; i < n; i++) {
+    if (tarefas[i].m.bytes != esperado) {
+      printf("# %s: thread %d transferiu %ld bytes, esperados %ld\n", carga, i, tarefas[i].m.bytes, esperado);
+      ok = 0;
+    }
+    medida_junta(&m, &tarefas[i].m);
+  }
+  //a aceleração só é informada: depende dos núcleos da máquina
+  double taxa = mbps(m.bytes, m.segundos);
+  if (n == 1) {
+    mbps_uma_thread[f] = taxa;
+  } else if (n > nucleos) {
+    printf("# %s: %d threads em %ld núcleos, aceleração não medida\n", carga, n, nucleos);
+  } else if (mbps_uma_thread[f] > 0) {
+    printf("# %s: %.2fx a taxa com uma thread\n", carga, taxa / mbps_uma_thread[f]);
+  }
+  relata(carga, &m, ok);
+  return ok;
+}
+
+/* cada thread deixou o seu arquivo com exatamente BENCH_THREAD_TOTAL bytes */
+int confere_tamanhos(int n) {
+  int ok = 1;
+
+  for (int i = 0; i < n; i++) {
+    char nome[16];
+    int fd;
+    sprintf(nome, "th%d", i);
+    if ((fd = fs_open(nome, FS_R)) == -1) {
+      return 0;
+    }
+    long long tam = fs_seek(0, FS_SEEK_END, fd);
+    fs_close(fd);
+    if (tam != BENCH_THREAD_TOTAL) {
+      printf("# threads%d: th%d tem %lld bytes, esperados %d\n", n, i, tam, BENCH_THREAD_TOTAL);
+      ok = 0;
+    }
+  }
+  return ok;
+}
+
+int bench_threads(int n) {
+  char carga[32];
+  int ok = fresca();
+  long long livre = fs_free();
+  long passadas = (long) BENCH_THREAD_TOTAL * BENCH_THREAD_PASSES;
+
+  sprintf(carga, "threads%d_escrita", n);
+  ok &= fase(carga, 0, n, escreve_thread, BENCH_THREAD_TOTAL);
+  ok &= confere_tamanhos(n);
+  sprintf(carga, "threads%d_leitura", n);
+  ok &= fase(carga, 1, n, le_thread, passadas);
+  sprintf(carga, "threads%d_mesmo_arq", n);
+  ok &= fase(carga, 2, n, le_quente_thread, passadas);
+
+  for (int i = 0; i < n; i++) {
+    char nome[16];
+    sprintf(nome, "th%d", i);
+    fs_remove(nome);
+  }
+  //removidos os arquivos, nenhum cluster pode ter vazado
+  if (fs_free() != livre) {
+    printf("# threads%d: clusters vazaram\n", n);
+    ok = 0;
+  }
+  return ok;
+}
+
+/* tamanho do arquivo i da importação, nunca múltiplo de um cluster */
+long tamanho_importado(int i) {
+  return (long) (i % 16 + 1) * BENCH_IMPORT_UNIT + i * 101 + 1;
+}
+
+/* cria no host o arquivo i da importação, com o conteúdo padrao(i, ...) */
+int grava_host(char *caminho, int i, char *buffer) {
+  long tam = tamanho_importado(i);
+  int fd = open(caminho, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  int ok = fd != -1;
+
+  for (long feito = 0; ok && feito < tam; ) {
+    int n = tam - feito < BENCH_THREAD_REQ ? (int) (tam - feito) : BENCH_THREAD_REQ;
+    for (int k = 0; k < n; k++) {
+      buffer[k] = padrao(i, feito + k);
+    }
+    ok = write(fd, buffer, n) == n;
+    feito += n;
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  return ok;
+}
+
+/* o arquivo i da importação tem na imagem o tamanho e o conteúdo da origem */
+int confere_importado(char *nome, int i, char *buffer) {
+  long tam = tamanho_importado(i);
+  long lido = 0;
+  int fd = fs_open(nome, FS_R);
+  int n, ok = fd != -1;
+
+  while (ok && (n = fs_read(buffer, BENCH_THREAD_REQ, fd)) > 0) {
+    for (int k = 0; k < n; k++) {
+      ok &= buffer[k] == padrao(i, lido + k);
+    }
+    lido += n;
+  }
+  if (fd != -1) {
+    fs_close(fd);
+  }
+  return ok && lido == tam;
+}
+
+/* acrescenta clusters clusters de zeros ao arquivo aberto em fd */
+int acrescenta_clusters(int fd, long long clusters, char *buffer) {
+  long long resta = clusters * SECTORSIZE;
+
+  memset(buffer, 0, BENCH_THREAD_REQ);
+  while (resta > 0) {
+    int n = resta < BENCH_THREAD_REQ ? (int) resta : BENCH_THREAD_REQ;
+    if (fs_write(buffer, n, fd) != n) {
+      return 0;
+    }
+    resta -= n;
+  }
+  return 1;
+}
+
+/*
+ * Deixa livres exatamente clusters clusters, em buracos de
+ * BENCH_IMPORT_HOLE clusters espalhados pela imagem: "buracos" e "enche",
+ * já criados, crescem alternadamente um cluster por vez até ocupar o disco
+ * todo e "buracos" é removido. Cada um já tem um cluster, assim "buracos"
+ * recebe mais clusters - 1 e "enche" o resto.
+ */
+int fragmenta(long long clusters, char *buffer) {
+  long long resta = fs_free() / SECTORSIZE - (clusters - 1);
+  long long buracos = clusters - 1;
+  int a = fs_open("buracos", FS_W), b = fs_open("enche", FS_W);
+  int ok = a != -1 && b != -1 && resta >= 0;
+
+  //sem acumular nem pré-alocar, cada escrita toma os próximos clusters livres
+  fs_alloc_mode(FS_ALLOC_CLUSTER);
+  fs_sync_policy(FS_SYNC_WRITE);
+  while (ok && buracos > 0) {
+    int n = buracos < BENCH_IMPORT_HOLE ? (int) buracos : BENCH_IMPORT_HOLE;
+    ok = acrescenta_clusters(a, n, buffer);
+    buracos -= n;
+    n = resta < BENCH_IMPORT_HOLE ? (int) resta : BENCH_IMPORT_HOLE;
+    ok = ok && acrescenta_clusters(b, n, buffer);
+    resta -= n;
+  }
+  fs_sync_policy(FS_SYNC_CLOSE);
+  ok = ok && acrescenta_clusters(b, resta, buffer);
+  if (a != -1) {
+    fs_close(a);
+  }
+  if (b != -1) {
+    fs_close(b);
+  }
+  fs_alloc_mode(FS_ALLOC_EXTENT);
+  ok = ok && fs_free() == 0 && fs_remove("buracos");
+  if (ok && fs_free() != clusters * SECTORSIZE) {
+    printf("# importacao: %lld bytes livres, esperados %lld\n", fs_free(), clusters * SECTORSIZE);
+    ok = 0;
+  }
+  return ok;
+}
+
+/*
+ * Importa BENCH_IMPORT_FILES arquivos numa imagem cujo espaço livre é
+ * exatamente o que eles ocupam (com o cluster padrão, SECTORSIZE), em
+ * buracos menores que eles: uma reserva maior que o necessário deixaria
+ * outro arquivo sem espaço. Com threads > 0 é um fs_import_files; com 0,
+ * um fs_import por vez com os descritores de todos os destinos abertos até
+ * o fim, assim uma sobra de reserva em qualquer um falta a um dos
+ * seguintes. Os destinos já existem, assim o diretório não cresce.
+ */
+int bench_importacao(int threads) {
+  char diretorio[] = "/tmp/rsfs-bench-XXXXXX";
+  char *caminhos[BENCH_IMPORT_FILES], *nomes[BENCH_IMPORT_FILES];
+  char *buffer = malloc(BENCH_THREAD_REQ);
+  long long total = 0, copiados = 0, clusters = 0;
+  int descritores[BENCH_IMPORT_FILES];
+  char carga[32];
+  medida m;
+  int importados = 0;
+  int ok = buffer != NULL && mkdtemp(diretorio) != NULL && fresca();
+
+  for (int i = 0; i < BENCH_IMPORT_FILES; i++) {
+    caminhos[i] = malloc(sizeof(diretorio) + 16);
+    nomes[i] = malloc(16);
+    if (caminhos[i] == NULL || nomes[i] == NULL) {
+      ok = 0;
+      continue;
+    }
+    sprintf(caminhos[i], "%s/i%d", diretorio, i);
+    sprintf(nomes[i], "i%d", i);
+    ok = ok && grava_host(caminhos[i], i, buffer) && fs_create(nomes[i]);
+    total += tamanho_importado(i);
+    //além do cluster inicial que o destino já tem, um por cluster completo
+    clusters += tamanho_importado(i) / SECTORSIZE;
+  }
+
+  ok = ok && fs_create("buracos") && fs_create("enche") && fragmenta(clusters, buffer);
+  medida_inicia(&m);
+  if (ok && threads > 0) {
+    medida_abre(&m);
+    double inicio = agora();
+    importados = fs_import_files(caminhos, nomes, BENCH_IMPORT_FILES, threads, &copiados);
+    medida_op(&m, inicio, copiados);
+    medida_fecha(&m);
+  } else if (ok) {
+    for (int i = 0; i < BENCH_IMPORT_FILES; i++) {
+      descritores[i] = fs_open(nomes[i], FS_W);
+    }
+    medida_abre(&m);
+    for (int i = 0; i < BENCH_IMPORT_FILES; i++) {
+      int origem = open(caminhos[i], O_RDONLY);
+      double inicio = agora();
+      long long c = origem != -1 && descritores[i] != -1 ? fs_import(origem, descritores[i]) : -1;
+      medida_op(&m, inicio, c > 0 ? c : 0);
+      if (c == tamanho_importado(i)) {
+        importados++;
+        copiados += c;
+      }
+      if (origem != -1) {
+        close(origem);
+      }
+    }
+    medida_fecha(&m);
+    for (int i = 0; i < BENCH_IMPORT_FILES; i++) {
+      if (descritores[i] != -1) {
+        fs_close(descritores[i]);
+      }
+    }
+  }
+  ok &= importados == BENCH_IMPORT_FILES && copiados == total;
+  if (ok && fs_free() != 0) {
+    printf("# importacao: %lld bytes livres depois, esperado 0\n", fs_free());
+    ok = 0;
+  }
+  for (int i = 0; ok && i < BENCH_IMPORT_FILES; i++) {
+    ok = confere_importado(nomes[i], i, buffer);
+  }
+  if (threads > 0) {
+    sprintf(carga, "importacao_threads%d", threads);
+  } else {
+    sprintf(carga, "importacao_abertos");
+  }
+  relata(carga, &m, ok);
+
+  for (int i = 0; i < BENCH_IMPORT_FILES; i++) {
+    if (caminhos[i] != NULL) {
+      unlink(caminhos[i]);
+    }
+    free(caminhos[i]);
+    free(nomes[i]);
+  }
+  rmdir(diretorio);
+  free(buffer);
+  return ok;
+}
+
+/*
+ * Montagens (fs_init) de uma imagem de mb MiB já povoada. Roda num
+ * processo à parte porque cada imagem precisa do seu próprio bl_init; o
+ * pico de memória residente desse processo sai num comentário.
+ */
+int bench_montagem(int mb, int backend) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    char *buffer = calloc(1, BENCH_MOUNT_FILE_SIZE);
+    char carga[32];
+    medida m;
+    int ok = buffer != NULL;
+
+    unlink(BENCH_MOUNT_IMAGE);
+    if (!ok || !bl_init(BENCH_MOUNT_IMAGE, mb * 1024 * 1024 / SECTORSIZE, backend) || !fs_init()) {
+      _exit(EXIT_FAILURE);
+    }
+    for (int i = 0; ok && i < BENCH_MOUNT_FILES; i++) {
+      char nome[16];
+      int fd = -1;
+      sprintf(nome, "m%d", i);
+      ok = fs_create(nome) && (fd = fs_open(nome, FS_W)) != -1
+           && fs_write(buffer, BENCH_MOUNT_FILE_SIZE, fd) == BENCH_MOUNT_FILE_SIZE;
+      fs_close(fd);
+    }
+    fs_sync();
+    //a primeira montagem refaz o diário; as medidas são das seguintes
+    ok &= fs_init();
+    long long livre = fs_free();
+    //cada montagem lê da imagem, não do cache de setores
+    bl_cache_size(0);
+    medida_inicia(&m);
+    medida_abre(&m);
+    for (int i = 0; i < BENCH_MOUNTS; i++) {
+      double inicio = agora();
+      ok &= fs_init();
+      medida_op(&m, inicio, 0);
+      ok &= fs_free() == livre;
+    }
+    medida_fecha(&m);
+    sprintf(carga, "montagem_%dMiB", mb);
+    relata(carga, &m, ok);
+    unlink(BENCH_MOUNT_IMAGE);
+    _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+  //o pico de memória residente é o do filho, que só montou esta imagem
+  struct rusage uso;
+  int status;
+  if (pid <= 0 || wait4(pid, &status, 0, &uso) != pid) {
+    return 0;
+  }
+  printf("# montagem_%dMiB: pico de memória residente %ld KiB\n", mb, uso.ru_maxrss);
+  return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+  int backend = BL_PREAD;
+  int tamanhos[] = {1, 10, 4096, 1024 * 1024};
+  int imagens[] = {16, 64, 256};
+  int ok = 1;
+
+  if (argc > 1 && !strcmp(argv[1], "-m")) {
+    backend = BL_MMAP;
+    argv++;
+    argc--;
+  }
+  char *image = argc > 1 ? argv[1] : BENCH_IMAGE;
+
+  if ((nucleos = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+    nucleos = 1;
+  }
+  printf("# rsfs-bench backend=%s imagem=%dMiB nucleos=%ld\n", backend == BL_MMAP ? "mmap" : "pread",
+         BENCH_IMAGE_MB, nucleos);
+  cabecalho();
+
+  //as montagens rodam em processos filhos, antes deste processo abrir a sua imagem
+  for (unsigned int i = 0; i < sizeof(imagens) / sizeof(imagens[0]); i++) {
+    ok &= bench_montagem(imagens[i], backend);
+  }
+
+  unlink(image);
+  if (!bl_init(image, BENCH_IMAGE_MB * 1024 * 1024 / SECTORSIZE, backend) || !fs_init()) {
+    exit(EXIT_FAILURE);
+  }
+
+  ok &= bench_churn();
+  ok &= bench_consultas();
+  for (unsigned int i = 0; i < sizeof(tamanhos) / sizeof(tamanhos[0]); i++) {
+    ok &= bench_rw(tamanhos[i]);
+  }
+  ok &= bench_rw_mesmo_descritor();
+  for (int n = 1; n <= BENCH_THREADS_MAX; n *= 2) {
+    ok &= bench_threads(n);
+  }
+  ok &= bench_importacao(0);
+  ok &= bench_importacao(BENCH_THREADS_MAX);
+
+  unlink(image);
+  exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
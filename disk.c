@@ -20,19 +20,260 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "disk.h"
 
-int device_size;
+long device_size;
 FILE *stream;
+int fd = -1;    /* descritor de stream, usado com pread/pwrite */
 
-int bl_init(char *file, int size) {
+/* máximo de setores por chamada preadv/pwritev (o MAXIOV do Linux) */
+#define MAXIOV 1024
+
+/*
+ * Com o backend BL_MMAP a imagem inteira fica mapeada em mapa e os setores
+ * são lidos e escritos com memcpy, sem o cache de setores. A faixa de bytes
+ * alterada desde o último bl_sync é guardada para o msync.
+ */
+int backend = BL_PREAD;
+char *mapa = NULL;
+long mapa_sujo_ini = -1;
+long mapa_sujo_fim = -1;
+
+/*
+ * Cache de setores com política LRU e escrita atrasada (write-back). Os
+ * setores sujos só vão para a imagem quando são despejados do cache ou
+ * em bl_sync().
+ */
+typedef struct {
+  int sector;   /* -1 se a entrada está livre */
+  char sujo;
+  int ant;      /* vizinhos na lista LRU (mais recente na cabeça) */
+  int prox;
+  int hprox;    /* próxima entrada no mesmo balde da tabela hash */
+} bloco_cache;
+
+int cache_tam = BL_CACHE_SECTORS;
+int cache_baldes = 0;
+bloco_cache *cache = NULL;
+char *cache_dados = NULL;
+int *cache_hash = NULL;
+int lru_cabeca = -1;
+int lru_cauda = -1;
+int cache_livre = -1;
+
+long cache_acertos = 0;
+long cache_faltas = 0;
+long cache_despejos = 0;
+
+/*
+ * O cache, a faixa suja do mapeamento e os contadores são protegidos por
+ * disco_trava. Só as faixas (bl_readv, bl_writev e os pedidos
+ * assíncronos) vão à imagem fora dela. Uma falta em bl_read, o despejo de
+ * um setor sujo em cache_reserva e a descarga do cache fazem pread/pwrite
+ * com a trava, então setores avulsos de arquivos diferentes ainda se
+ * esperam quando não estão no cache.
+ * cache_geracao conta os setores sujos que o cache gravou na imagem: quem
+ * leu direto do disco enquanto ela mudou pode ter perdido uma versão que
+ * saiu do cache e relê a faixa.
+ */
+pthread_mutex_t disco_trava = PTHREAD_MUTEX_INITIALIZER;
+long cache_geracao = 0;
+
+/*
+ * Contadores de E/S na imagem, sempre ligados e atualizados sem trava:
+ * bytes lidos e gravados (com a imagem mapeada, os copiados de/para o
+ * mapeamento), chamadas ao sistema feitas na imagem e, entre elas, as que
+ * esperam a imagem chegar ao disco (fdatasync e msync).
+ */
+long es_bytes_lidos = 0;
+long es_bytes_gravados = 0;
+long es_chamadas = 0;
+long es_sincronizacoes = 0;
+
+void conta_es(long *contador, long bytes, int chamadas) {
+  __atomic_add_fetch(contador, bytes, __ATOMIC_RELAXED);
+  if (chamadas > 0) {
+    __atomic_add_fetch(&es_chamadas, chamadas, __ATOMIC_RELAXED);
+  }
+}
+
+/* um fdatasync ou msync na imagem: é chamada ao sistema e sincronização */
+void conta_sync() {
+  __atomic_add_fetch(&es_chamadas, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&es_sincronizacoes, 1, __ATOMIC_RELAXED);
+}
+
+int disco_escreve(int sector, char *buffer) {
+  if (pwrite(fd, buffer, SECTORSIZE, (off_t) sector * SECTORSIZE) != SECTORSIZE) {
+    perror("Erro escrevendo setor");
+    return 0;
+  }
+  conta_es(&es_bytes_gravados, SECTORSIZE, 1);
+  return 1;
+}
+
+int disco_le(int sector, char *buffer) {
+  if (pread(fd, buffer, SECTORSIZE, (off_t) sector * SECTORSIZE) != SECTORSIZE) {
+    perror("Erro lendo setor");
+    return 0;
+  }
+  conta_es(&es_bytes_lidos, SECTORSIZE, 1);
+  return 1;
+}
+
+/* grava count setores consecutivos a partir de sector, um buffer por setor */
+int disco_escreve_v(int sector, char **buffers, int count) {
+  struct iovec iov[MAXIOV];
+
+  for (int feito = 0; feito < count; ) {
+    int n = count - feito < MAXIOV ? count - feito : MAXIOV;
+    for (int i = 0; i < n; i++) {
+      iov[i].iov_base = buffers[feito + i];
+      iov[i].iov_len = SECTORSIZE;
+    }
+    if (pwritev(fd, iov, n, (off_t) (sector + feito) * SECTORSIZE) != (ssize_t) n * SECTORSIZE) {
+      perror("Erro escrevendo setores");
+      return 0;
+    }
+    conta_es(&es_bytes_gravados, (long) n * SECTORSIZE, 1);
+    feito += n;
+  }
+  return 1;
+}
+
+int disco_le_v(int sector, char **buffers, int count) {
+  struct iovec iov[MAXIOV];
+
+  for (int feito = 0; feito < count; ) {
+    int n = count - feito < MAXIOV ? count - feito : MAXIOV;
+    for (int i = 0; i < n; i++) {
+      iov[i].iov_base = buffers[feito + i];
+      iov[i].iov_len = SECTORSIZE;
+    }
+    if (preadv(fd, iov, n, (off_t) (sector + feito) * SECTORSIZE) != (ssize_t) n * SECTORSIZE) {
+      perror("Erro lendo setores");
+      return 0;
+    }
+    conta_es(&es_bytes_lidos, (long) n * SECTORSIZE, 1);
+    feito += n;
+  }
+  return 1;
+}
+
+void lru_remove(int i) {
+  if (cache[i].ant != -1) cache[cache[i].ant].prox = cache[i].prox;
+  else lru_cabeca = cache[i].prox;
+  if (cache[i].prox != -1) cache[cache[i].prox].ant = cache[i].ant;
+  else lru_cauda = cache[i].ant;
+}
+
+void lru_insere(int i) {
+  cache[i].ant = -1;
+  cache[i].prox = lru_cabeca;
+  if (lru_cabeca != -1) cache[lru_cabeca].ant = i;
+  lru_cabeca = i;
+  if (lru_cauda == -1) lru_cauda = i;
+}
+
+int cache_busca(int sector) {
+  int i = cache_hash[sector % cache_baldes];
+  while (i != -1 && cache[i].sector != sector) {
+    i = cache[i].hprox;
+  }
+  return i;
+}
+
+void hash_remove(int i) {
+  int *p = &cache_hash[cache[i].sector % cache_baldes];
+  while (*p != i) {
+    p = &cache[*p].hprox;
+  }
+  *p = cache[i].hprox;
+}
+
+/* devolve a entrada i à lista de livres, sem gravar o conteúdo */
+void cache_solta(int i) {
+  lru_remove(i);
+  hash_remove(i);
+  cache[i].sector = -1;
+  cache[i].prox = cache_livre;
+  cache_livre = i;
+}
+
+/* reserva uma entrada para o setor, despejando a menos usada se preciso */
+int cache_reserva(int sector) {
+  int i;
+
+  if (cache_livre != -1) {
+    i = cache_livre;
+    cache_livre = cache[i].prox;
+  } else {
+    i = lru_cauda;
+    if (cache[i].sujo) {
+      if (!disco_escreve(cache[i].sector, cache_dados + (long) i * SECTORSIZE)) {
+        return -1;
+      }
+      cache_geracao++;
+    }
+    lru_remove(i);
+    hash_remove(i);
+    cache_despejos++;
+  }
+  cache[i].sector = sector;
+  cache[i].sujo = 0;
+  cache[i].hprox = cache_hash[sector % cache_baldes];
+  cache_hash[sector % cache_baldes] = i;
+  lru_insere(i);
+  return i;
+}
+
+int cache_aloca() {
+  cache_baldes = cache_tam * 2 + 1;
+  cache = malloc(sizeof(bloco_cache) * cache_tam);
+  cache_dados = malloc((long) SECTORSIZE * cache_tam);
+  cache_hash = malloc(sizeof(int) * cache_baldes);
+  if (cache == NULL || cache_dados == NULL || cache_hash == NULL) {
+    printf("Sem memória para o cache de setores\n");
+    return 0;
+  }
+  for (int i = 0; i < cache_baldes; i++) {
+    cache_hash[i] = -1;
+  }
+  for (int i = 0; i < cache_tam; i++) {
+    cache[i].sector = -1;
+    cache[i].prox = i + 1 < cache_tam ? i + 1 : -1;
+  }
+  cache_livre = 0;
+  lru_cabeca = lru_cauda = -1;
+  return 1;
+}
+
+void cache_libera() {
+  free(cache);
+  free(cache_dados);
+  free(cache_hash);
+  cache = NULL;
+  cache_dados = NULL;
+  cache_hash = NULL;
+}
+
+int bl_init(char *file, int size, int backend_escolhido) {
   struct stat sb;
 
   stream = NULL;
+  backend = backend_escolhido;
   if (stat(file, &sb) == 0) {
     if (S_ISREG(sb.st_mode)) {
       device_size = sb.st_size;
@@ -43,7 +284,7 @@ int bl_init(char *file, int size) {
       return 0;
     }
   } else {
-    device_size = size * SECTORSIZE;
+    device_size = (long) size * SECTORSIZE;
     if (device_size < 1) {
       printf("Imagem não pode ter tamanho zero\n");
       return 0;
@@ -58,37 +299,864 @@ int bl_init(char *file, int size) {
       return 0;
     }
   }
+  fd = fileno(stream);
+  if (backend == BL_MMAP) {
+    mapa = mmap(NULL, device_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapa == MAP_FAILED) {
+      perror("Mapeando imagem na memória");
+      mapa = NULL;
+      return 0;
+    }
+    return 1;
+  }
+  if (cache_tam > 0 && cache == NULL && !cache_aloca()) {
+    return 0;
+  }
   return 1; 
 }
 
+/* confere os limites da imagem, que no mapeamento não pode crescer */
+int mapa_setor_valido(int sector) {
+  if (sector < 0 || sector >= bl_size()) {
+    printf("Erro! Setor %d fora da imagem\n", sector);
+    return 0;
+  }
+  return 1;
+}
+
+/* estende a faixa suja do mapeamento para cobrir os bytes [inicio, fim) */
+void mapa_marca_sujo(long inicio, long fim) {
+  pthread_mutex_lock(&disco_trava);
+  if (mapa_sujo_ini == -1 || inicio < mapa_sujo_ini) {
+    mapa_sujo_ini = inicio;
+  }
+  if (fim > mapa_sujo_fim) {
+    mapa_sujo_fim = fim;
+  }
+  pthread_mutex_unlock(&disco_trava);
+}
+
+int mapa_escreve(int sector, char *buffer) {
+  long inicio = (long) sector * SECTORSIZE;
+
+  if (!mapa_setor_valido(sector)) {
+    return 0;
+  }
+  memcpy(mapa + inicio, buffer, SECTORSIZE);
+  mapa_marca_sujo(inicio, inicio + SECTORSIZE);
+  conta_es(&es_bytes_gravados, SECTORSIZE, 0);
+  return 1;
+}
+
+int mapa_le(int sector, char *buffer) {
+  if (!mapa_setor_valido(sector)) {
+    return 0;
+  }
+  memcpy(buffer, mapa + (long) sector * SECTORSIZE, SECTORSIZE);
+  conta_es(&es_bytes_lidos, SECTORSIZE, 0);
+  return 1;
+}
+
+int mapa_sync() {
+  if (mapa_sujo_ini != -1) {
+    //msync exige início alinhado à página; SECTORSIZE é múltiplo dela
+    conta_sync();
+    if (msync(mapa + mapa_sujo_ini, mapa_sujo_fim - mapa_sujo_ini, MS_SYNC) == -1) {
+      perror("Erro gravando setores mapeados no disco");
+      return 0;
+    }
+    mapa_sujo_ini = mapa_sujo_fim = -1;
+  }
+  return 1;
+}
+
 int bl_size() {
   return device_size / SECTORSIZE;
 }
 
 int bl_write(int sector, char *buffer) {
-  if (fseek(stream, sector * SECTORSIZE, SEEK_SET) == -1) {
-    perror("Erro posicionando setor para escrita");
+  int i;
+
+  if (mapa != NULL) {
+    return mapa_escreve(sector, buffer);
+  }
+  //sem cache a escrita vai direto à imagem; chegar ao disco fica para bl_sync
+  if (cache == NULL) {
+    return disco_escreve(sector, buffer);
+  }
+  pthread_mutex_lock(&disco_trava);
+  i = cache_busca(sector);
+  if (i == -1) {
+    //o setor é sobrescrito por inteiro, não precisa lê-lo do disco
+    if ((i = cache_reserva(sector)) == -1) {
+      pthread_mutex_unlock(&disco_trava);
+      return 0;
+    }
+  } else {
+    lru_remove(i);
+    lru_insere(i);
+  }
+  memcpy(cache_dados + (long) i * SECTORSIZE, buffer, SECTORSIZE);
+  cache[i].sujo = 1;
+  pthread_mutex_unlock(&disco_trava);
+  return 1;
+}
+
+int bl_read(int sector, char *buffer){
+  int i;
+
+  if (mapa != NULL) {
+    return mapa_le(sector, buffer);
+  }
+  if (cache == NULL) {
+    return disco_le(sector, buffer);
+  }
+  pthread_mutex_lock(&disco_trava);
+  i = cache_busca(sector);
+  if (i != -1) {
+    cache_acertos++;
+    lru_remove(i);
+    lru_insere(i);
+  } else {
+    cache_faltas++;
+    if ((i = cache_reserva(sector)) == -1) {
+      pthread_mutex_unlock(&disco_trava);
+      return 0;
+    }
+    if (!disco_le(sector, cache_dados + (long) i * SECTORSIZE)) {
+      //não deixa lixo no cache se a leitura falhou
+      cache_solta(i);
+      pthread_mutex_unlock(&disco_trava);
+      return 0;
+    }
+  }
+  memcpy(buffer, cache_dados + (long) i * SECTORSIZE, SECTORSIZE);
+  pthread_mutex_unlock(&disco_trava);
+  return 1;
+}
+
+int compara_setor(const void *a, const void *b) {
+  return cache[*(int *) a].sector - cache[*(int *) b].sector;
+}
+
+/*
+ * Copia sobre buffers, lidos do disco enquanto a geração do cache era
+ * geracao, as versões sujas (mais novas que o disco) que estão no cache.
+ * Chamada com disco_trava; se o cache gravou setores nesse meio tempo a
+ * faixa é relida antes.
+ */
+int cache_sobrepoe(int sector, char **buffers, int count, long geracao) {
+  if (geracao != cache_geracao && !disco_le_v(sector, buffers, count)) {
     return 0;
   }
-  if (fwrite(buffer, sizeof(char), SECTORSIZE, stream) != SECTORSIZE) {
-    perror("Erro escrevendo setor");
+  for (int k = 0; k < count; k++) {
+    int i = cache_busca(sector + k);
+    if (i != -1 && cache[i].sujo) {
+      memcpy(buffers[k], cache_dados + (long) i * SECTORSIZE, SECTORSIZE);
+    }
+  }
+  return 1;
+}
+
+long geracao_atual() {
+  return __atomic_load_n(&cache_geracao, __ATOMIC_ACQUIRE);
+}
+
+/* o disco vai receber os setores direto; as cópias no cache passam a ser iguais a eles */
+void cache_atualiza(int sector, char **buffers, int count) {
+  for (int k = 0; k < count; k++) {
+    int i = cache_busca(sector + k);
+    if (i != -1) {
+      memcpy(cache_dados + (long) i * SECTORSIZE, buffers[k], SECTORSIZE);
+      cache[i].sujo = 0;
+    }
+  }
+}
+
+/*
+ * Leva à imagem tudo o que foi gravado até aqui e só volta quando está no
+ * disco: msync no mapeamento ou, no backend pread, os setores sujos do
+ * cache seguidos de fdatasync. Quem ordena gravações (o diário antes dos
+ * lugares definitivos) usa bl_sync como barreira.
+ */
+int bl_sync() {
+  //escritas assíncronas em voo precisam chegar à imagem antes
+  if (!bl_aio_drain()) {
     return 0;
   }
-  if (fflush(stream) != 0) {
-    perror("Erro gravando setor no disco");
+  if (mapa != NULL) {
+    pthread_mutex_lock(&disco_trava);
+    int ok = mapa_sync();
+    pthread_mutex_unlock(&disco_trava);
+    return ok;
+  }
+  if (cache != NULL) {
+    int *sujos = malloc(sizeof(int) * cache_tam);
+    char **buffers = malloc(sizeof(char *) * cache_tam);
+    int n = 0;
+
+    if (sujos == NULL || buffers == NULL) {
+      printf("Sem memória para sincronizar o cache\n");
+      free(sujos);
+      free(buffers);
+      return 0;
+    }
+    pthread_mutex_lock(&disco_trava);
+    for (int i = lru_cabeca; i != -1; i = cache[i].prox) {
+      if (cache[i].sujo) {
+        sujos[n++] = i;
+      }
+    }
+    //grava em ordem crescente de setor, juntando setores consecutivos num só pwritev
+    qsort(sujos, n, sizeof(int), compara_setor);
+    for (int k = 0; k < n; ) {
+      int fim = k + 1;
+      while (fim < n && cache[sujos[fim]].sector == cache[sujos[fim - 1]].sector + 1) {
+        fim++;
+      }
+      for (int j = k; j < fim; j++) {
+        buffers[j - k] = cache_dados + (long) sujos[j] * SECTORSIZE;
+      }
+      if (!disco_escreve_v(cache[sujos[k]].sector, buffers, fim - k)) {
+        pthread_mutex_unlock(&disco_trava);
+        free(sujos);
+        free(buffers);
+        return 0;
+      }
+      for (int j = k; j < fim; j++) {
+        cache[sujos[j]].sujo = 0;
+      }
+      __atomic_add_fetch(&cache_geracao, fim - k, __ATOMIC_RELEASE);
+      k = fim;
+    }
+    pthread_mutex_unlock(&disco_trava);
+    free(sujos);
+    free(buffers);
+  }
+  //pwritev só entrega ao kernel; o fdatasync espera chegar ao disco
+  conta_sync();
+  if (fdatasync(fd) == -1) {
+    perror("Erro sincronizando a imagem");
     return 0;
   }
   return 1;
 }
 
-int bl_read(int sector, char *buffer){
-  if (fseek(stream, sector * SECTORSIZE, SEEK_SET) == -1) {
-    perror("Erro posicionando setor para leitura");
+int bl_readv(int sector, char **buffers, int count) {
+  if (mapa != NULL) {
+    for (int k = 0; k < count; k++) {
+      if (!mapa_le(sector + k, buffers[k])) {
+        return 0;
+      }
+    }
+    return 1;
+  }
+  long geracao = geracao_atual();
+  int ok;
+  if (!disco_le_v(sector, buffers, count)) {
     return 0;
   }
-  if (fread(buffer, sizeof(char), SECTORSIZE, stream) != SECTORSIZE) {
-    perror("Erro lendo setor");
+  if (cache == NULL) {
+    return 1;
+  }
+  pthread_mutex_lock(&disco_trava);
+  ok = cache_sobrepoe(sector, buffers, count, geracao);
+  pthread_mutex_unlock(&disco_trava);
+  return ok;
+}
+
+int bl_writev(int sector, char **buffers, int count) {
+  if (mapa != NULL) {
+    for (int k = 0; k < count; k++) {
+      if (!mapa_escreve(sector + k, buffers[k])) {
+        return 0;
+      }
+    }
+    return 1;
+  }
+  //o cache é atualizado antes, assim um despejo não grava por cima uma versão antiga
+  if (cache != NULL) {
+    pthread_mutex_lock(&disco_trava);
+    cache_atualiza(sector, buffers, count);
+    pthread_mutex_unlock(&disco_trava);
+  }
+  return disco_escreve_v(sector, buffers, count);
+}
+
+/* monta o vetor de ponteiros de setor para uma faixa contígua na memória */
+char **faixa_buffers(char *buffer, int count) {
+  char **buffers = malloc(sizeof(char *) * count);
+  if (buffers == NULL) {
+    printf("Sem memória para a faixa de setores\n");
+    return NULL;
+  }
+  for (int k = 0; k < count; k++) {
+    buffers[k] = buffer + (long) k * SECTORSIZE;
+  }
+  return buffers;
+}
+
+int bl_read_range(int sector, int count, char *buffer) {
+  char **buffers;
+  long geracao = geracao_atual();
+  int ok;
+
+  if (mapa != NULL) {
+    if (count <= 0 || !mapa_setor_valido(sector) || !mapa_setor_valido(sector + count - 1)) {
+      return 0;
+    }
+    memcpy(buffer, mapa + (long) sector * SECTORSIZE, (long) count * SECTORSIZE);
+    conta_es(&es_bytes_lidos, (long) count * SECTORSIZE, 0);
+    return 1;
+  }
+  if (pread(fd, buffer, (size_t) count * SECTORSIZE, (off_t) sector * SECTORSIZE)
+      != (ssize_t) count * SECTORSIZE) {
+    perror("Erro lendo setores");
     return 0;
   }
+  conta_es(&es_bytes_lidos, (long) count * SECTORSIZE, 1);
+  if (cache == NULL) {
+    return 1;
+  }
+  if ((buffers = faixa_buffers(buffer, count)) == NULL) {
+    return 0;
+  }
+  pthread_mutex_lock(&disco_trava);
+  ok = cache_sobrepoe(sector, buffers, count, geracao);
+  pthread_mutex_unlock(&disco_trava);
+  free(buffers);
+  return ok;
+}
+
+int bl_write_range(int sector, int count, char *buffer) {
+  char **buffers;
+  int ok;
+
+  if ((buffers = faixa_buffers(buffer, count)) == NULL) {
+    return 0;
+  }
+  ok = bl_writev(sector, buffers, count);
+  free(buffers);
+  return ok;
+}
+
+int bl_cache_size(int sectors) {
+  if (cache != NULL) {
+    if (!bl_sync()) {
+      return 0;
+    }
+    cache_libera();
+  }
+  cache_tam = sectors;
+  if (cache_tam > 0 && stream != NULL && mapa == NULL) {
+    return cache_aloca();
+  }
+  return 1;
+}
+
+void bl_io_stats(long *sectors_read, long *sectors_written, long *calls, long *syncs) {
+  *sectors_read = __atomic_load_n(&es_bytes_lidos, __ATOMIC_RELAXED) / SECTORSIZE;
+  *sectors_written = __atomic_load_n(&es_bytes_gravados, __ATOMIC_RELAXED) / SECTORSIZE;
+  *calls = __atomic_load_n(&es_chamadas, __ATOMIC_RELAXED);
+  *syncs = __atomic_load_n(&es_sincronizacoes, __ATOMIC_RELAXED);
+}
+
+void bl_cache_stats(long *hits, long *misses, long *evictions) {
+  pthread_mutex_lock(&disco_trava);
+  *hits = cache_acertos;
+  *misses = cache_faltas;
+  *evictions = cache_despejos;
+  pthread_mutex_unlock(&disco_trava);
+}
+
+char *bl_map(int sector) {
+  if (mapa == NULL || !mapa_setor_valido(sector)) {
+    return NULL;
+  }
+  return mapa + (long) sector * SECTORSIZE;
+}
+
+/*
+ * Transferência entre a imagem e um descritor do host, a partir da posição
+ * atual dele. Com a imagem mapeada o read/write do host usa o próprio
+ * mapeamento como buffer; no backend pread o copy_file_range copia dentro
+ * do kernel, sem os dados passarem pelo processo. Quando o kernel ou o
+ * tipo do descritor não permitem (pipe, outro sistema de arquivos em
+ * kernels antigos) a cópia passa por um buffer de COPIA_BUFFER bytes.
+ */
+#define COPIA_BUFFER (1024 * 1024)
+
+/* grava n bytes, em pos se não for NULL, senão na posição atual de para */
+int grava_tudo(int para, char *buffer, long n, off_t *pos) {
+  for (long feito = 0; feito < n; ) {
+    ssize_t c = pos ? pwrite(para, buffer + feito, n - feito, *pos) : write(para, buffer + feito, n - feito);
+    if (c <= 0) {
+      return 0;
+    }
+    if (pos) *pos += c;
+    feito += c;
+  }
   return 1;
 }
+
+/* copia até n bytes de de para para por um buffer; devolve quantos, -1 em erro */
+long copia_buffer(int de, off_t *de_pos, int para, off_t *para_pos, long n) {
+  char *buffer = malloc(COPIA_BUFFER);
+  long feito = 0;
+
+  if (buffer == NULL) {
+    return -1;
+  }
+  while (feito < n) {
+    long parte = n - feito < COPIA_BUFFER ? n - feito : COPIA_BUFFER;
+    ssize_t lidos = de_pos ? pread(de, buffer, parte, *de_pos) : read(de, buffer, parte);
+    if (lidos == 0) {
+      break;
+    }
+    if (lidos < 0 || !grava_tudo(para, buffer, lidos, para_pos)) {
+      feito = -1;
+      break;
+    }
+    if (de_pos) *de_pos += lidos;
+    feito += lidos;
+  }
+  free(buffer);
+  return feito;
+}
+
+/* copia até n bytes entre descritores, dentro do kernel quando possível */
+long copia_direta(int de, off_t *de_pos, int para, off_t *para_pos, long n) {
+  long feito = 0;
+
+  while (feito < n) {
+    long c = syscall(__NR_copy_file_range, de, de_pos, para, para_pos, (size_t) (n - feito), 0);
+    if (c == 0) {
+      break;
+    }
+    if (c < 0) {
+      if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP) {
+        return -1;
+      }
+      c = copia_buffer(de, de_pos, para, para_pos, n - feito);
+      return c < 0 ? -1 : feito + c;
+    }
+    feito += c;
+  }
+  return feito;
+}
+
+long bl_import(int host_fd, int sector, int count) {
+  long total = (long) count * SECTORSIZE;
+  long feito = 0;
+
+  if (count <= 0 || sector < 0 || sector + count > bl_size()) {
+    printf("Erro! Faixa de setores fora da imagem\n");
+    return -1;
+  }
+  if (mapa != NULL) {
+    char *destino = mapa + (long) sector * SECTORSIZE;
+    ssize_t c = 0;
+    while (feito < total && (c = read(host_fd, destino + feito, total - feito)) > 0) {
+      feito += c;
+    }
+    if (feito > 0) {
+      mapa_marca_sujo((long) sector * SECTORSIZE, (long) sector * SECTORSIZE + feito);
+      conta_es(&es_bytes_gravados, feito, 0);
+    }
+    if (c < 0) {
+      perror("Erro importando para a imagem");
+      return -1;
+    }
+    return feito;
+  }
+  if (cache != NULL) {
+    //as cópias em cache, mesmo sujas, ficaram velhas e não podem voltar ao disco
+    pthread_mutex_lock(&disco_trava);
+    for (int k = 0; k < count; k++) {
+      int i = cache_busca(sector + k);
+      if (i != -1) {
+        cache_solta(i);
+      }
+    }
+    pthread_mutex_unlock(&disco_trava);
+  }
+  off_t destino = (off_t) sector * SECTORSIZE;
+  if ((feito = copia_direta(host_fd, NULL, fd, &destino, total)) < 0) {
+    perror("Erro importando para a imagem");
+  } else {
+    conta_es(&es_bytes_gravados, feito, 1);
+  }
+  return feito;
+}
+
+long bl_export(int host_fd, int sector, int count) {
+  long total = (long) count * SECTORSIZE;
+
+  if (count <= 0 || sector < 0 || sector + count > bl_size()) {
+    printf("Erro! Faixa de setores fora da imagem\n");
+    return -1;
+  }
+  if (mapa != NULL) {
+    if (!grava_tudo(host_fd, mapa + (long) sector * SECTORSIZE, total, NULL)) {
+      perror("Erro exportando da imagem");
+      return -1;
+    }
+    conta_es(&es_bytes_lidos, total, 0);
+    return total;
+  }
+  if (cache != NULL) {
+    //a cópia é feita do disco, então as versões sujas da faixa vão para ele antes
+    pthread_mutex_lock(&disco_trava);
+    for (int k = 0; k < count; k++) {
+      int i = cache_busca(sector + k);
+      if (i != -1 && cache[i].sujo) {
+        if (!disco_escreve(sector + k, cache_dados + (long) i * SECTORSIZE)) {
+          pthread_mutex_unlock(&disco_trava);
+          return -1;
+        }
+        cache[i].sujo = 0;
+        cache_geracao++;
+      }
+    }
+    pthread_mutex_unlock(&disco_trava);
+  }
+  off_t origem = (off_t) sector * SECTORSIZE;
+  long feito = copia_direta(fd, &origem, host_fd, NULL, total);
+  if (feito < 0) {
+    perror("Erro exportando da imagem");
+  } else {
+    conta_es(&es_bytes_lidos, feito, 1);
+  }
+  return feito;
+}
+
+/*
+ * E/S assíncrona. Cada pedido ocupa uma posição de aio[], cujo índice é a
+ * etiqueta devolvida por bl_aio_submit. O pedido é executado pelo io_uring
+ * quando o kernel oferece, senão por um grupo de threads; com a imagem
+ * mapeada ele é feito na hora com memcpy. A sobreposição das cópias sujas
+ * do cache nas leituras é feita em bl_aio_wait, na thread de quem pediu.
+ * A tabela aio[] e os anéis do io_uring são protegidos por aio_trava; uma
+ * thread por vez recolhe as conclusões do io_uring e acorda as demais.
+ */
+#define AIO_LIVRE 0
+#define AIO_EM_VOO 1
+#define AIO_PRONTO 2
+
+#define AIO_THREADS 4
+
+typedef struct {
+  char estado;
+  char op;
+  char ok;
+  int sector;
+  int count;
+  char *buffer;
+  long geracao;   /* geração do cache quando a leitura foi pedida */
+  struct iovec iov;
+} pedido_aio;
+
+pedido_aio aio[BL_AIO_DEPTH];
+int aio_motor = BL_AIO_NONE;
+
+pthread_mutex_t aio_trava = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t aio_tem_pedido = PTHREAD_COND_INITIALIZER;
+pthread_cond_t aio_terminou = PTHREAD_COND_INITIALIZER;
+int aio_fila[BL_AIO_DEPTH];
+int aio_fila_ini = 0;
+int aio_fila_n = 0;
+int uring_colhendo = 0;
+
+int ur_fd = -1;
+unsigned *sq_cauda, *sq_mascara, *sq_vetor;
+unsigned *cq_cabeca, *cq_cauda, *cq_mascara;
+struct io_uring_sqe *sqes;
+struct io_uring_cqe *cqes;
+
+/* executa o pedido de forma síncrona, terminando leituras/escritas curtas */
+int aio_executa(pedido_aio *p, long feito) {
+  long total = (long) p->count * SECTORSIZE;
+
+  while (feito < total) {
+    ssize_t r;
+    off_t pos = (off_t) p->sector * SECTORSIZE + feito;
+    if (p->op == BL_AIO_READ) {
+      r = pread(fd, p->buffer + feito, total - feito, pos);
+    } else {
+      r = pwrite(fd, p->buffer + feito, total - feito, pos);
+    }
+    if (r <= 0) {
+      perror(p->op == BL_AIO_READ ? "Erro lendo setores" : "Erro escrevendo setores");
+      return 0;
+    }
+    conta_es(p->op == BL_AIO_READ ? &es_bytes_lidos : &es_bytes_gravados, r, 1);
+    feito += r;
+  }
+  return 1;
+}
+
+void *aio_trabalhador(void *arg) {
+  (void) arg;
+
+  pthread_mutex_lock(&aio_trava);
+  while (1) {
+    while (aio_fila_n == 0) {
+      pthread_cond_wait(&aio_tem_pedido, &aio_trava);
+    }
+    int i = aio_fila[aio_fila_ini];
+    aio_fila_ini = (aio_fila_ini + 1) % BL_AIO_DEPTH;
+    aio_fila_n--;
+    pthread_mutex_unlock(&aio_trava);
+
+    int ok = aio_executa(&aio[i], 0);
+
+    pthread_mutex_lock(&aio_trava);
+    aio[i].ok = ok;
+    aio[i].estado = AIO_PRONTO;
+    pthread_cond_broadcast(&aio_terminou);
+  }
+  return NULL;
+}
+
+int uring_inicia() {
+  struct io_uring_params p;
+  char *sq, *cq;
+  size_t sq_tam, cq_tam;
+
+  memset(&p, 0, sizeof(p));
+  ur_fd = syscall(__NR_io_uring_setup, BL_AIO_DEPTH, &p);
+  if (ur_fd < 0) {
+    return 0;
+  }
+  sq_tam = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_tam = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_tam = cq_tam = sq_tam > cq_tam ? sq_tam : cq_tam;
+  }
+  sq = mmap(NULL, sq_tam, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur_fd, IORING_OFF_SQ_RING);
+  cq = sq;
+  if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    cq = mmap(NULL, cq_tam, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur_fd, IORING_OFF_CQ_RING);
+  }
+  sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ur_fd, IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+    close(ur_fd);
+    ur_fd = -1;
+    return 0;
+  }
+  sq_cauda = (unsigned *) (sq + p.sq_off.tail);
+  sq_mascara = (unsigned *) (sq + p.sq_off.ring_mask);
+  sq_vetor = (unsigned *) (sq + p.sq_off.array);
+  cq_cabeca = (unsigned *) (cq + p.cq_off.head);
+  cq_cauda = (unsigned *) (cq + p.cq_off.tail);
+  cq_mascara = (unsigned *) (cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  return 1;
+}
+
+int uring_envia(int i) {
+  unsigned cauda = *sq_cauda;
+  unsigned pos = cauda & *sq_mascara;
+  struct io_uring_sqe *sqe = &sqes[pos];
+
+  aio[i].iov.iov_base = aio[i].buffer;
+  aio[i].iov.iov_len = (size_t) aio[i].count * SECTORSIZE;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = aio[i].op == BL_AIO_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long) &aio[i].iov;
+  sqe->len = 1;
+  sqe->off = (off_t) aio[i].sector * SECTORSIZE;
+  sqe->user_data = i;
+  sq_vetor[pos] = pos;
+  __atomic_store_n(sq_cauda, cauda + 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&es_chamadas, 1, __ATOMIC_RELAXED);
+  if (syscall(__NR_io_uring_enter, ur_fd, 1, 0, 0, NULL, 0) != 1) {
+    //o núcleo não consumiu a entrada: a cauda volta para que ela não seja
+    //enviada depois junto com a próxima, já tendo sido executada aqui
+    __atomic_store_n(sq_cauda, cauda, __ATOMIC_RELEASE);
+    return 0;
+  }
+  return 1;
+}
+
+/* recolhe as conclusões do io_uring, esperando por pelo menos uma se pedido */
+void uring_colhe(int esperar) {
+  unsigned cabeca = *cq_cabeca;
+
+  if (esperar && cabeca == __atomic_load_n(cq_cauda, __ATOMIC_ACQUIRE)) {
+    __atomic_add_fetch(&es_chamadas, 1, __ATOMIC_RELAXED);
+    syscall(__NR_io_uring_enter, ur_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+  }
+  while (cabeca != __atomic_load_n(cq_cauda, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &cqes[cabeca & *cq_mascara];
+    pedido_aio *p = &aio[cqe->user_data];
+    if (cqe->res > 0) {
+      conta_es(p->op == BL_AIO_READ ? &es_bytes_lidos : &es_bytes_gravados, cqe->res, 0);
+    }
+    //um resultado curto é completado de forma síncrona
+    int ok = cqe->res >= 0 && aio_executa(p, cqe->res);
+    pthread_mutex_lock(&aio_trava);
+    p->ok = ok;
+    p->estado = AIO_PRONTO;
+    pthread_mutex_unlock(&aio_trava);
+    cabeca++;
+  }
+  __atomic_store_n(cq_cabeca, cabeca, __ATOMIC_RELEASE);
+}
+
+int bl_aio_init(int engine) {
+  if (aio_motor != BL_AIO_NONE) {
+    return aio_motor;
+  }
+  if (engine == BL_AIO_URING && uring_inicia()) {
+    aio_motor = BL_AIO_URING;
+    return aio_motor;
+  }
+  for (int t = 0; t < AIO_THREADS; t++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, aio_trabalhador, NULL) != 0) {
+      perror("Criando threads de E/S assíncrona");
+      return aio_motor;
+    }
+    pthread_detach(thread);
+  }
+  aio_motor = BL_AIO_THREADS;
+  return aio_motor;
+}
+
+int bl_aio_submit(int op, int sector, int count, char *buffer) {
+  int i;
+
+  pthread_mutex_lock(&aio_trava);
+  if (aio_motor == BL_AIO_NONE && mapa == NULL && bl_aio_init(BL_AIO_URING) == BL_AIO_NONE) {
+    pthread_mutex_unlock(&aio_trava);
+    return -1;
+  }
+  for (i = 0; i < BL_AIO_DEPTH && aio[i].estado != AIO_LIVRE; i++);
+  if (i == BL_AIO_DEPTH) {
+    pthread_mutex_unlock(&aio_trava);
+    return -1;
+  }
+  //a posição fica ocupada enquanto o pedido é preparado fora da trava
+  aio[i].estado = AIO_EM_VOO;
+  pthread_mutex_unlock(&aio_trava);
+  aio[i].op = op;
+  aio[i].sector = sector;
+  aio[i].count = count;
+  aio[i].buffer = buffer;
+  aio[i].geracao = geracao_atual();
+  aio[i].ok = 0;
+
+  if (mapa != NULL) {
+    int ok = op == BL_AIO_READ ? bl_read_range(sector, count, buffer)
+                               : bl_write_range(sector, count, buffer);
+    pthread_mutex_lock(&aio_trava);
+    aio[i].ok = ok;
+    aio[i].estado = AIO_PRONTO;
+    pthread_cond_broadcast(&aio_terminou);
+    pthread_mutex_unlock(&aio_trava);
+    return i;
+  }
+  if (op == BL_AIO_WRITE && cache != NULL) {
+    //as cópias no cache ficam com o conteúdo novo e limpas, como em bl_writev
+    char **buffers = faixa_buffers(buffer, count);
+    if (buffers == NULL) {
+      pthread_mutex_lock(&aio_trava);
+      aio[i].estado = AIO_LIVRE;
+      pthread_cond_broadcast(&aio_terminou);
+      pthread_mutex_unlock(&aio_trava);
+      return -1;
+    }
+    pthread_mutex_lock(&disco_trava);
+    cache_atualiza(sector, buffers, count);
+    pthread_mutex_unlock(&disco_trava);
+    free(buffers);
+  }
+
+  pthread_mutex_lock(&aio_trava);
+  if (aio_motor == BL_AIO_URING) {
+    if (!uring_envia(i)) {
+      aio[i].ok = aio_executa(&aio[i], 0);
+      aio[i].estado = AIO_PRONTO;
+      pthread_cond_broadcast(&aio_terminou);
+    }
+  } else {
+    aio_fila[(aio_fila_ini + aio_fila_n) % BL_AIO_DEPTH] = i;
+    aio_fila_n++;
+    pthread_cond_signal(&aio_tem_pedido);
+  }
+  pthread_mutex_unlock(&aio_trava);
+  return i;
+}
+
+/*
+ * Espera o pedido i terminar, chamada com aio_trava. Com o io_uring a
+ * primeira thread a esperar recolhe as conclusões (fora da trava) e as
+ * outras dormem até ela acordá-las.
+ */
+void aio_espera_pronto(int i) {
+  while (aio[i].estado == AIO_EM_VOO) {
+    if (aio_motor == BL_AIO_URING && !uring_colhendo) {
+      uring_colhendo = 1;
+      pthread_mutex_unlock(&aio_trava);
+      uring_colhe(1);
+      pthread_mutex_lock(&aio_trava);
+      uring_colhendo = 0;
+      pthread_cond_broadcast(&aio_terminou);
+    } else {
+      pthread_cond_wait(&aio_terminou, &aio_trava);
+    }
+  }
+}
+
+int bl_aio_wait(int tag) {
+  pedido_aio p;
+
+  if (tag < 0 || tag >= BL_AIO_DEPTH) {
+    return 0;
+  }
+  pthread_mutex_lock(&aio_trava);
+  if (aio[tag].estado == AIO_LIVRE) {
+    pthread_mutex_unlock(&aio_trava);
+    return 0;
+  }
+  aio_espera_pronto(tag);
+  p = aio[tag];
+  aio[tag].estado = AIO_LIVRE;
+  pthread_mutex_unlock(&aio_trava);
+
+  if (p.ok && p.op == BL_AIO_READ && cache != NULL) {
+    char **buffers = faixa_buffers(p.buffer, p.count);
+    if (buffers != NULL) {
+      pthread_mutex_lock(&disco_trava);
+      p.ok = cache_sobrepoe(p.sector, buffers, p.count, p.geracao);
+      pthread_mutex_unlock(&disco_trava);
+      free(buffers);
+    }
+  }
+  return p.ok;
+}
+
+/*
+ * Espera todos os pedidos em voo chegarem à imagem. As posições continuam
+ * ocupadas até cada dono chamar bl_aio_wait, que é quem recebe o resultado;
+ * o retorno é 0 se alguma escrita pendente falhou.
+ */
+int bl_aio_drain() {
+  int ok = 1;
+
+  pthread_mutex_lock(&aio_trava);
+  for (int i = 0; i < BL_AIO_DEPTH; i++) {
+    if (aio[i].estado == AIO_LIVRE) {
+      continue;
+    }
+    aio_espera_pronto(i);
+    if (aio[i].op == BL_AIO_WRITE && !aio[i].ok) {
+      ok = 0;
+    }
+  }
+  pthread_mutex_unlock(&aio_trava);
+  return ok;
+}
@@ -22,7 +22,48 @@
 
 #define SECTORSIZE 4096
 
-int bl_init(char *file, int size);
+/* backends de acesso à imagem escolhidos em bl_init */
+#define BL_PREAD 0  /* pread/pwrite no arquivo, com cache de setores */
+#define BL_MMAP 1   /* imagem mapeada na memória (mmap) */
+
+/* tamanho padrão do cache de setores (em setores); 0 desliga o cache */
+#define BL_CACHE_SECTORS 256
+
+/* E/S assíncrona: operações, motores e pedidos em voo ao mesmo tempo */
+#define BL_AIO_READ 0
+#define BL_AIO_WRITE 1
+
+#define BL_AIO_NONE 0
+#define BL_AIO_URING 1    /* io_uring, se o kernel oferecer */
+#define BL_AIO_THREADS 2  /* grupo de threads com pread/pwrite */
+
+#define BL_AIO_DEPTH 64
+
+int bl_init(char *file, int size, int backend);
 int bl_size();
 int bl_write(int sector, char* buffer);
 int bl_read(int sector, char* buffer);
+int bl_sync();
+int bl_cache_size(int sectors);
+void bl_cache_stats(long *hits, long *misses, long *evictions);
+
+/* setores lidos e gravados na imagem, chamadas ao sistema feitas nela e fdatasync/msync */
+void bl_io_stats(long *sectors_read, long *sectors_written, long *calls, long *syncs);
+char *bl_map(int sector);
+int bl_read_range(int sector, int count, char *buffer);
+int bl_write_range(int sector, int count, char *buffer);
+int bl_readv(int sector, char **buffers, int count);
+int bl_writev(int sector, char **buffers, int count);
+
+/*
+ * Cópia direta entre count setores a partir de sector e um descritor do
+ * host, na posição atual dele. Devolvem os bytes copiados (menos que
+ * count setores se a origem acabou antes), -1 em erro.
+ */
+long bl_import(int host_fd, int sector, int count);
+long bl_export(int host_fd, int sector, int count);
+
+int bl_aio_init(int engine);
+int bl_aio_submit(int op, int sector, int count, char *buffer);
+int bl_aio_wait(int tag);
+int bl_aio_drain();
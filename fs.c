@@ -20,29 +20,127 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "disk.h"
 #include "fs.h"
 
-#define CLUSTERSIZE 4096
-#define FATCLUSTERS 65536
-#define DIRENTRIES 128
-#define DIRINDEX 32
-#define MAXOPENFILES 10
+/* tamanho do cluster: potência de 2 entre CLUSTERSIZE_MIN e CLUSTERSIZE_MAX */
+#define CLUSTERSIZE_MIN SECTORSIZE
+#define CLUSTERSIZE_MAX (1024 * 1024)
+#define MAXOPENFILES 1024
 
-unsigned short fat[FATCLUSTERS];
+/* escrita em segundo plano: buffers por arquivo e bytes por buffer */
+#define TRECHOS 4
+#define TRECHOBYTES (256 * 1024)
 
+/* máximo de leituras assíncronas em voo num mesmo fs_read */
+#define LEITURASVOO 16
+
+/* leitura antecipada: posições e bytes do anel de cada arquivo e janela inicial */
+#define RAMAX 64
+#define RABYTES (256 * 1024)
+#define RAJANELA_MIN 4
+
+/* buffer de escrita por arquivo, cujos clusters só são escolhidos ao descarregá-lo */
+#define ACUMULO_PADRAO (1024 * 1024)
+
+/* pré-alocação de clusters contíguos para arquivos abertos para escrita, em bytes */
+#define PREALOCA_MIN (1024 * 1024)
+#define PREALOCA_MAX (16 * 1024 * 1024)
+
+/*
+ * Geometria da imagem, gravada no superbloco (setor 0) por fs_format e
+ * lida em fs_init. O cluster c ocupa os setores a partir de c *
+ * setores_cluster. A FAT começa no setor 1 e o diário logo depois dela; os
+ * clusters do superbloco, da FAT e do diário ficam marcados com 3 na FAT
+ * e o diretório começa no cluster seguinte, dir_inicio. Como os valores 1
+ * a 5 da FAT são marcadores, dir_inicio é pelo menos 6.
+ */
+int tam_cluster = CLUSTERSIZE_MIN;
+int setores_cluster = 1;
+int fat_inicio = 1;
+int fat_setores = 0;
+int dir_inicio = 0;
+int formatado = 0;
+int tam_cluster_formatacao = CLUSTERSIZE_MIN;  // usado pelo próximo fs_format
+
+/* tamanhos que dependem do cluster: anel de leitura, buffers de escrita e pré-alocação */
+int ra_posicoes = RAMAX;
+int trecho_clusters = TRECHOBYTES / CLUSTERSIZE_MIN;
+int prealoca_min = PREALOCA_MIN / CLUSTERSIZE_MIN;
+int prealoca_max = PREALOCA_MAX / CLUSTERSIZE_MIN;
+
+/* E/S de clusters, traduzidos para os setores da imagem */
+int le_cluster(int cluster, char *buffer) {
+  if (setores_cluster == 1) {
+    return bl_read(cluster, buffer);
+  }
+  return bl_read_range(cluster * setores_cluster, setores_cluster, buffer);
+}
+
+int grava_cluster(int cluster, char *buffer) {
+  if (setores_cluster == 1) {
+    return bl_write(cluster, buffer);
+  }
+  return bl_write_range(cluster * setores_cluster, setores_cluster, buffer);
+}
+
+int le_clusters(int cluster, int n, char *buffer) {
+  return bl_read_range(cluster * setores_cluster, n * setores_cluster, buffer);
+}
+
+int grava_clusters(int cluster, int n, char *buffer) {
+  return bl_write_range(cluster * setores_cluster, n * setores_cluster, buffer);
+}
+
+/* 64 bytes, assim um setor guarda um número inteiro de entradas */
 typedef struct {
   char used;
   char name[25];
-  unsigned short first_block;
-  int size;
+  unsigned int first_block;
+  long long size;
+  char reservado[24];
 } dir_entry;
 
-dir_entry dir[DIRENTRIES];
+/*
+ * O diretório é uma cadeia de clusters na FAT que começa em dir_inicio e
+ * termina com o marcador 4. Em memória fica num vetor contíguo que cresce
+ * um cluster (ENTRADASCLUSTER entradas) por vez; as marcas de sujo são por
+ * setor (ENTRADASSETOR entradas), assim um cluster grande não é regravado
+ * inteiro por causa de uma entrada.
+ */
+#define ENTRADASCLUSTER (tam_cluster / sizeof(dir_entry))
+#define ENTRADASSETOR (SECTORSIZE / sizeof(dir_entry))
+
+dir_entry *dir = NULL;
+int dir_entradas = 0;        // capacidade atual do vetor dir
+int *dir_clusters = NULL;    // cluster da imagem de cada pedaço do diretório
+int dir_nclusters = 0;
+
 
+/*
+ * Leitura antecipada de um arquivo lido em sequência. Os clusters lógicos
+ * seguintes são buscados em segundo plano para um anel de ra_posicoes
+ * clusters (até RAMAX, conforme o tamanho do cluster), na posição (cluster
+ * lógico % ra_posicoes). A janela dobra a cada nova busca enquanto a
+ * leitura continuar sequencial.
+ */
+typedef struct {
+  char *dados;
+  int logico[RAMAX];   // cluster lógico em cada posição, -1 se vazia
+  int tag[RAMAX];      // etiqueta bl_aio da leitura que traz a posição, -1 se pronta
+  char usado[RAMAX];
+  int proximo;         // próximo cluster lógico a antecipar
+  int janela;
+} leitura_antecipada;
 
 typedef struct {
   int primeiro;
@@ -50,408 +148,3172 @@ typedef struct {
   int dirIndex;
   int posicaoEscrita;
   int posicaoLeitura;
-  int totalLido;
+  long long totalLido;
+  long long posicao;  // posição de fs_read/fs_write nos modos de escrita
+  int *mapa;          // cluster da imagem de cada cluster lógico do arquivo
+  int mapaTam;
+  int mapaCap;
+  int reservaInicio;  // próximo cluster pré-alocado ainda não usado
+  int reservaFim;     // fim (exclusivo) da extensão pré-alocada
+  int reservaTam;     // tamanho da próxima pré-alocação
+  char reservaExata;  // reservaTam é o que falta ao arquivo e não dobra
   char categoria;
   char ocupado;
-  char memoria[CLUSTERSIZE];
+  char carregado;     // memoria contém o bloco fim (leitura)
+  int ultimoLogico;   // último cluster lógico lido, para detectar acesso sequencial
+  int sequencia;      // clusters lidos em sequência até agora
+  leitura_antecipada *ra;
+  char *trecho[TRECHOS];   // cópias de clusters inteiros sendo gravadas em segundo plano
+  int trechoTag[TRECHOS];  // etiqueta bl_aio de cada cópia, -1 se já terminou
+  int trechoProx;
+  char *pendente;     // bytes acrescentados ao fim e ainda sem clusters
+  int pendenteTam;
+  int pendenteMax;    // quanto o buffer aceita antes de descarregar
+  int proxLivre;      // próximo descritor da lista de livres
+  char *memoria;      // um cluster tirado de buffers_livres
 } arquivosAbertos;
 
-arquivosAbertos listaArquivos[DIRENTRIES];
-
-/* funções para escrita das estruturas de dados no disco */
-void escreve_disco(){
-	char *fatBytes;
-	char buffer[CLUSTERSIZE];
-
-	// percorre a fat por bytes e anota as informações dentro do buffer depois escreve no disco
-	fatBytes = (char *)fat;
-	for (int i=0,h=0;i<FATCLUSTERS>>1;i+=CLUSTERSIZE,h++){
-		for (int j=i,k=0;j<CLUSTERSIZE;j++,k++)
-			 buffer[k] = fatBytes[j];
+/*
+ * Tabela de descritores. Os devolvidos formam uma lista encadeada por
+ * proxLivre e os nunca usados começam em descritores_novos, assim abrir e
+ * fechar custam O(1). Vários descritores podem
+ * apontar para a mesma entrada do diretório, cada um com seu cursor e seus
+ * buffers: dir_abertos conta quantos há por entrada e dir_escrita marca a
+ * entrada aberta num modo de escrita, que não admite outros descritores.
+ */
+arquivosAbertos descritores[MAXOPENFILES];
+int descritor_livre = -1;
+int descritores_novos = 0;
+int *dir_abertos = NULL;
+char *dir_escrita = NULL;
 
-		bl_write(h, buffer);
-	}
-}
+/* buffers de um cluster devolvidos pelos descritores fechados, encadeados pelo início */
+char *buffers_livres = NULL;
 
-void escreve_dir_disco(){
-	char buffer[CLUSTERSIZE];
-	int tam_bytes_dir = sizeof(dir_entry) * DIRENTRIES;
-	char *dir_bytes = (char *)dir;
+/* protege a lista de descritores livres e buffers_livres */
+pthread_mutex_t trava_tabela = PTHREAD_MUTEX_INITIALIZER;
 
-	//percorre o diretório em bytes e escreve neles até o tamanho do diretório
-	for(int i=0;i<tam_bytes_dir;i++) buffer[i] = dir_bytes[i];
+/*
+ * Travas para uso concorrente da API. As operações sobre o diretório
+ * (create, remove, open, list, sync) passam uma por vez por trava_dir. Cada
+ * descritor é protegido pela trava do seu grupo (descritor %
+ * TRAVASARQUIVOS), a única que read/write/seek tomam, assim arquivos
+ * diferentes andam em paralelo. Mudar os vetores do diretório de lugar
+ * exige todos os grupos. A FAT, o mapa de livres e as marcas de setores
+ * sujos ficam com trava_fat. A ordem é sempre diretório, arquivo, FAT.
+ */
+#define TRAVASARQUIVOS 64
 
-	//percorre o resto e escreve o resto com 0 se tiver resto
-	for(int i=tam_bytes_dir;i<CLUSTERSIZE;i++) buffer[i] = 0;
+pthread_mutex_t trava_dir = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t trava_fat = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t travas_arquivos[TRAVASARQUIVOS] = {
+  [0 ... TRAVASARQUIVOS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
 
-	bl_write(DIRINDEX, buffer);
+void trava_arquivo(int file) {
+  pthread_mutex_lock(&travas_arquivos[(unsigned) file % TRAVASARQUIVOS]);
 }
 
+void destrava_arquivo(int file) {
+  pthread_mutex_unlock(&travas_arquivos[(unsigned) file % TRAVASARQUIVOS]);
+}
 
-int verifica_formatacao(){
-  int i=0;
-  while(i<32 && fat[i] == 3){
-    i++;
+void trava_todos() {
+  for (int t = 0; t < TRAVASARQUIVOS; t++) {
+    pthread_mutex_lock(&travas_arquivos[t]);
   }
+}
 
-  //se estiver formatado errado
-  if (i!=32) //disco novo
-  {
-    printf("sistema de arquivos não formatado\n");
-    return 0;
+void destrava_todos() {
+  for (int t = TRAVASARQUIVOS - 1; t >= 0; t--) {
+    pthread_mutex_unlock(&travas_arquivos[t]);
   }
-
-  //se tiver formatado correto
-  return 1;
 }
 
-int fs_init() {  
-  //verificar se esta iniciado ou é disco novo
-  //se os 32 vprimeios espaços da fat são 3, então já foi inicado
- 
-  int sector=0;
-  for(;sector<32;sector++)
-    bl_read(sector, (char *) fat + SECTORSIZE * sector);
+/*
+ * A FAT, de 32 bits por entrada, fica na imagem e só em parte na memória:
+ * páginas de um setor (FATPORSETOR entradas) lidas quando alguém as usa.
+ * Passando de FATPAGINAS páginas, as limpas são descartadas pelo relógio
+ * (fat_usado faz as vezes do bit de referência). Uma página alterada só
+ * volta à imagem no ponto de controle, e até lá fica presa na memória; se
+ * as presas passam de metade do limite, a próxima transação do diário vira
+ * um ponto de controle.
+ */
+#define FATPAGINAS 4096
+#define FATLEITURA 64   // setores da FAT lidos ou gravados de uma vez fora das páginas
+#define FATPORSETOR (SECTORSIZE / sizeof(unsigned int))
 
-  for(;sector<33;sector++){
-    bl_read(sector, (char *) fat + SECTORSIZE * sector);
-    bl_read(sector, (char *) dir);
-  }
+unsigned int **fat_pagina = NULL;  // página de cada setor da FAT, NULL se não está na memória
+int fat_pagina_tam = 0;            // setores cobertos por fat_pagina, que podem não ser os da imagem nova
+char *fat_sujo = NULL;             // página alterada desde o último ponto de controle
+char *fat_usado = NULL;
+int fat_residentes = 0;
+int fat_sujos = 0;
+int fat_relogio = 0;
+char *dir_sujo = NULL;       // um por setor do diretório
 
-  //verifica se está formatado
-  int i=0;
-  while(i<32 && fat[i] == 3)
-  {
-    i++;
-  }
- 
-  if (i!=32) //disco novo
-  {
-    //se disco não estiver formatado, formata ele
-    fs_format();
-  }
+int politica_sync = FS_SYNC_CLOSE;
 
-  return 1;
+/* nas threads de fs_import_files os metadados só vão para o diário no fs_sync do fim */
+__thread int sync_adiado = 0;
+
+/* contadores de amplificação de escrita dos metadados */
+long setores_meta_gravados = 0;
+long bytes_usuario_gravados = 0;
+
+/*
+ * Contadores da busca por clusters livres, com trava_fat: buscas feitas,
+ * palavras de 64 bits do mapa de livres examinadas, as da busca mais longa
+ * e setores da FAT lidos porque os já lidos não tinham o que se procurava.
+ */
+long buscas_livres = 0;
+long palavras_varridas = 0;
+long maior_busca = 0;
+long setores_fat_buscados = 0;
+
+/*
+ * Histogramas de latência da API: o balde b de uma operação conta as
+ * chamadas que levaram de 2^b a 2^(b+1) - 1 ns. fs_read e fs_write, que
+ * podem ser só um memcpy, medem uma em cada FS_HIST_SAMPLE chamadas de
+ * cada thread; as outras operações medem todas.
+ */
+long histograma[FS_OPS][FS_HIST_BUCKETS];
+__thread unsigned int amostra[FS_OPS];
+
+long long relogio_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-int fs_format() {
-  //inicializando FAT
-  int i=0;
-  for(;i<32;i++){
-  	fat[i] = 3;
-  }
-  
-  for(;i<33;i++){
-  	fat[i] = 4;
+/* instante de início da chamada se ela vai ser medida, senão 0 */
+long long op_inicio(int op) {
+  if ((op == FS_OP_READ || op == FS_OP_WRITE) && amostra[op]++ % FS_HIST_SAMPLE != 0) {
+    return 0;
   }
+  return relogio_ns();
+}
 
-  for(;i<FATCLUSTERS;i++){
-  	fat[i] = 1;
+void op_fim(int op, long long inicio) {
+  if (inicio == 0) {
+    return;
   }
-  //inicializando Diretório
-  i=0;
-  for(;i<128;i++){
-  	dir[i].used = 0;
-  	memset(dir[i].name, ' ', 25*sizeof(char)); //inicializa o nome da string com " " em todas as celulas.
-  	dir[i].first_block = 0;
-  	dir[i].size = 0;
+  long long ns = relogio_ns() - inicio;
+  int balde = ns > 1 ? 63 - __builtin_clzll(ns) : 0;
+  if (balde >= FS_HIST_BUCKETS) {
+    balde = FS_HIST_BUCKETS - 1;
   }
+  __atomic_add_fetch(&histograma[op][balde], 1, __ATOMIC_RELAXED);
+}
 
-  //escrever as duas estruturas no disco
-  for (int sector = 0; sector < 32; sector++)
-  {
-    bl_write(sector, (char *) fat + SECTORSIZE * sector);
-  }
-  
-  bl_write(32, (char *) dir);
-  return 1;
+/*
+ * Registro das chamadas da API (fs_trace_start). Cada chamada vira um
+ * registro_traco de tamanho fixo, seguido do nome do arquivo quando há um,
+ * com o início em ns desde o começo do registro e a duração. Os dados
+ * lidos e escritos não são guardados, só os tamanhos: fs_trace_replay
+ * escreve um padrão no lugar. Os registros saem na ordem em que as
+ * chamadas terminam, sob trava_traco.
+ */
+#define TRACO_MAGICO 0x52545352u  // "RSTR"
+#define TRACO_VERSAO 1
+
+/* operações registradas além das FS_OP_* */
+#define TR_SEEK 6
+#define TR_PREAD 7
+#define TR_PWRITE 8
+#define TR_SYNC 9
+#define TR_FREE 10
+#define TR_LIST 11
+#define TR_FORMAT 12
+#define TR_IMPORT 13
+#define TR_EXPORT 14
+
+typedef struct {
+  unsigned char op;
+  unsigned char nome_tam;  // bytes do nome que seguem o registro
+  unsigned short arg;      // modo do fs_open, whence do fs_seek
+  int handle;
+  int tam;                 // bytes pedidos; tamanho do cluster no fs_format
+  unsigned int duracao;    // ns, saturado
+  long long offset;
+  long long resultado;
+  long long inicio;
+} registro_traco;
+
+pthread_mutex_t trava_traco = PTHREAD_MUTEX_INITIALIZER;
+FILE *traco = NULL;
+int traco_ativo = 0;
+long long traco_origem;
+
+/* instante de início da chamada se o registro está ligado, senão 0 */
+long long traco_inicio() {
+  return __atomic_load_n(&traco_ativo, __ATOMIC_RELAXED) ? relogio_ns() : 0;
 }
 
-//retorna o espaco livre no dispositivo (disco) em bytes.
-int fs_free() {
-  //verifica se esta formatado
-  if(!verifica_formatacao()){
-    return 0;
+void traco_fim(int op, long long inicio, char *nome, int arg, int handle, int tam,
+               long long offset, long long resultado) {
+  registro_traco r;
+
+  if (inicio == 0) {
+    return;
   }
+  long long duracao = relogio_ns() - inicio;
+  memset(&r, 0, sizeof(r));
+  r.op = op;
+  r.nome_tam = nome == NULL ? 0 : strlen(nome) < 255 ? strlen(nome) : 255;
+  r.arg = arg;
+  r.handle = handle;
+  r.tam = tam;
+  r.duracao = duracao < 0xffffffffLL ? duracao : 0xffffffffu;
+  r.offset = offset;
+  r.resultado = resultado;
+  pthread_mutex_lock(&trava_traco);
+  if (traco != NULL) {
+    r.inicio = inicio > traco_origem ? inicio - traco_origem : 0;
+    fwrite(&r, sizeof(r), 1, traco);
+    fwrite(nome, 1, r.nome_tam, traco);
+  }
+  pthread_mutex_unlock(&trava_traco);
+}
 
-  int celula_livre = 0;
-  //fat representa o disco, entao o espaco que tem livre nele e o que livre no disco, exceto os quebrados
-  for(int i=0;i<FATCLUSTERS;i++){
-    // printf("%d ", fat[i]);
-    if(fat[i] == 1){
-      celula_livre++;
+/*
+ * Mapa de bits dos clusters livres (bit 1 = livre), espelho das entradas
+ * com valor 1 na FAT que cabem na imagem, mantido por fat_set junto com o
+ * total de livres e a dica de next-fit. O mapa ganha os bits de um setor
+ * da FAT na primeira vez que ele é lido (fat_mapeado) e os mantém quando a
+ * página é descartada; o total de livres vem do superbloco.
+ */
+unsigned long long *livres_mapa = NULL;
+int livres_total = 0;
+int livres_dica = 0;
+int clusters_imagem = 0;
+int fat_livres = 0;          // entradas com valor 1 na FAT, sem descontar reservas
+char *fat_mapeado = NULL;
+
+/* tira da memória uma página limpa não usada desde a última volta do relógio */
+unsigned int *fat_despeja() {
+  for (int k = 0; k < 2 * fat_setores; k++) {
+    int s = fat_relogio;
+    fat_relogio = (fat_relogio + 1) % fat_setores;
+    if (fat_pagina[s] == NULL || fat_sujo[s]) {
+      continue;
     }
+    if (fat_usado[s]) {
+      fat_usado[s] = 0;
+      continue;
+    }
+    unsigned int *pagina = fat_pagina[s];
+    fat_pagina[s] = NULL;
+    fat_residentes--;
+    return pagina;
   }
-  //cada celula equivale a um setor, cada setor tem 4096 bytes (isto eh, um clustersize)
-  int total_bytes = celula_livre * CLUSTERSIZE;
-  return total_bytes;
+  return NULL;
 }
 
-// int fs_list(char *buffer, int size): Lista os arquivos do diretório, colocando a saída formatada em buffer. O formato é simples, um arquivo
-// por linha, seguido de seu tamanho e separado por dois tabs. Observe
-// que a sua função não deve escrever na tela.
-int fs_list(char *buffer, int size) {
-  if(!verifica_formatacao()){
-    return 0;
+/* traz o setor s da FAT para a memória e, na primeira vez, acende os bits dos livres; com trava_fat */
+unsigned int *fat_carrega(int s) {
+  unsigned int *pagina = fat_residentes >= FATPAGINAS ? fat_despeja() : NULL;
+  if (pagina == NULL && (pagina = malloc(SECTORSIZE)) == NULL && (pagina = fat_despeja()) == NULL) {
+    printf("Erro! Sem memória para a FAT\n");
+    exit(EXIT_FAILURE);
   }
-
-  //reseta o vetor buffer e apaga tudo que já estava escrito nele
-  memset(buffer, '\0', size);
-
-  int tamanho_usado = 0;
-  for(int i=0;i<DIRENTRIES;i++){
-    if(dir[i].used == 1){
-      char temp[50];
-      snprintf(temp, sizeof(temp), "%-25s %d    \n", dir[i].name, dir[i].size);
-      if(tamanho_usado + strlen(temp) < size){
-        strcat(buffer, temp);
+  bl_read(fat_inicio + s, (char *) pagina);
+  if (!fat_mapeado[s]) {
+    int base = s * FATPORSETOR;
+    int fim = base + (int) FATPORSETOR < clusters_imagem ? base + (int) FATPORSETOR : clusters_imagem;
+    for (int i = base; i < fim; i++) {
+      if (pagina[i - base] == 1) {
+        livres_mapa[i / 64] |= 1ULL << (i % 64);
       }
-      else{
-        printf("Erro. Buffer cheio!\n");
-        return 0;
-      } 
     }
+    fat_mapeado[s] = 1;
   }
-  return 1;
+  fat_pagina[s] = pagina;
+  fat_usado[s] = 1;
+  fat_residentes++;
+  return pagina;
 }
 
-int fs_create(char* file_name) {
-  if(!verifica_formatacao()){
-    return 0;
+/* entrada c da FAT, carregando o setor se preciso; com trava_fat */
+unsigned int fat_le(int c) {
+  int s = c / FATPORSETOR;
+  unsigned int *pagina = fat_pagina[s];
+  if (pagina == NULL) {
+    pagina = fat_carrega(s);
   }
+  fat_usado[s] = 1;
+  return pagina[c % FATPORSETOR];
+}
 
-  //verifica se ja tem arquivo com este nome
-  for(int i=0;i<DIRENTRIES;i++){
-    if(!strcmp(file_name, dir[i].name)){ //se arquivo dir tem msm nome 
-      printf("Erro! Ja existe um arquivo com esse nome\n");;
-      return 0;
+/* põe no mapa os livres do próximo setor ainda não lido a partir da dica, 0 se já estão todos */
+int fat_carrega_mais() {
+  int inicio = livres_dica / FATPORSETOR;
+  for (int k = 0; k < fat_setores; k++) {
+    int s = (inicio + k) % fat_setores;
+    if (!fat_mapeado[s]) {
+      setores_fat_buscados++;
+      fat_carrega(s);
+      return 1;
     }
   }
+  return 0;
+}
 
-  //procura uma celuala livre no FAT
-  int primeiro_bloco = -1;
-  for(int i=0;i<FATCLUSTERS;i++){
-    if(fat[i] == 1){
-      fat[i] = 2; //marca essa celula como incio e fim de um arquivo (o arquivo tem tamanho 0, por isso, o inicio e o fim eh igual)
-      primeiro_bloco = i;
-      break;
-    }
-  }
-  
-  if(primeiro_bloco == -1){
-    printf("FAT sem espaco\n");
-    return 0;
+/* descarta as páginas da FAT e o mapa de livres; cada setor será lido quando for usado */
+void livres_inicia() {
+  for (int s = 0; s < fat_pagina_tam; s++) {
+    free(fat_pagina[s]);
   }
+  free(fat_pagina);
+  free(fat_sujo);
+  free(fat_usado);
+  free(fat_mapeado);
+  free(livres_mapa);
+  fat_pagina = calloc(fat_setores, sizeof(unsigned int *));
+  fat_pagina_tam = fat_setores;
+  fat_sujo = calloc(fat_setores, 1);
+  fat_usado = calloc(fat_setores, 1);
+  fat_mapeado = calloc(fat_setores, 1);
+  livres_mapa = calloc((clusters_imagem + 63) / 64, sizeof(unsigned long long));
+  fat_residentes = fat_sujos = fat_relogio = 0;
+  livres_dica = 0;
+}
 
-  for(int i=0;i<DIRENTRIES;i++){
-    if(!dir[i].used){ //se celula esta livre
-      dir[i].used=!dir[i].used;
-      strcpy(dir[i].name,file_name);
-      dir[i].size = 0;
-      dir[i].first_block = primeiro_bloco;
-	  //tem que procurar no resto dos arquivos
-      break;
+/*
+ * Lê a FAT inteira e conta os livres, para imagens sem contagem confiável
+ * no superbloco. Os setores passam por um buffer, sem ocupar páginas; as
+ * páginas já na memória valem mais que a imagem.
+ */
+void livres_reconstroi() {
+  unsigned int *setores = malloc(FATLEITURA * SECTORSIZE);
+
+  memset(livres_mapa, 0, (clusters_imagem + 63) / 64 * sizeof(unsigned long long));
+  livres_total = 0;
+  for (int s = 0; s < fat_setores; s += FATLEITURA) {
+    int n = fat_setores - s < FATLEITURA ? fat_setores - s : FATLEITURA;
+    if (setores != NULL) {
+      bl_read_range(fat_inicio + s, n, (char *) setores);
+    }
+    for (int k = s; k < s + n; k++) {
+      unsigned int *pagina = fat_pagina[k];
+      if (pagina == NULL) {
+        pagina = setores != NULL ? setores + (k - s) * FATPORSETOR : fat_carrega(k);
+      }
+      int base = k * FATPORSETOR;
+      int fim = base + (int) FATPORSETOR < clusters_imagem ? base + (int) FATPORSETOR : clusters_imagem;
+      for (int i = base; i < fim; i++) {
+        if (pagina[i - base] == 1) {
+          livres_mapa[i / 64] |= 1ULL << (i % 64);
+          livres_total++;
+        }
+      }
+      fat_mapeado[k] = 1;
     }
   }
+  free(setores);
+  fat_livres = livres_total;
+}
 
-  /*escrever o bl_write. Corrigido em relação a primeria entrega*/ 
+int modo_alocacao = FS_ALLOC_EXTENT;
 
-  escreve_disco();
-  escreve_dir_disco();
+/* primeiro cluster em [c, limite) cujo bit vale livre (1) ou ocupado (0) */
+int proximo_bit(int c, int livre, int limite) {
+  while (c < limite) {
+    unsigned long long bits = livres_mapa[c / 64];
+    palavras_varridas++;
+    if (!livre) {
+      bits = ~bits;
+    }
+    bits &= ~0ULL << (c % 64);
+    if (bits) {
+      int achado = (c / 64) * 64 + __builtin_ctzll(bits);
+      return achado < limite ? achado : limite;
+    }
+    c = (c / 64 + 1) * 64;
+  }
+  return limite;
+}
 
-  return 1;
+/* conta uma busca por livres, que começou com antes palavras varridas */
+void conta_busca(long antes) {
+  buscas_livres++;
+  if (palavras_varridas - antes > maior_busca) {
+    maior_busca = palavras_varridas - antes;
+  }
 }
 
-int fs_remove(char *file_name) {
-  if(!verifica_formatacao()){
-    return 0;
+/* procura um cluster livre a partir da dica, uma palavra de 64 bits por vez */
+int aloca_cluster() {
+  int cluster;
+  long antes = palavras_varridas;
+
+  if (livres_total == 0) {
+    return -1;
   }
-  
-  //procura a celuala no FAT
-  for(int i=0;i<DIRENTRIES;i++){
-    if(!strcmp(file_name, dir[i].name)){ //se arquivo dir tem msm nome do arquivo para remover
-      dir[i].used = 0;
-      memset(dir[i].name, ' ', 25*sizeof(char)); //inicializa o nome da string com " " em todas as celulas.
-      dir[i].size = 0;
-
-      int bloco_procurar = dir[i].first_block;
-      int temp = -1;
-      while(temp != 2){
-        temp = fat[bloco_procurar];
-        fat[bloco_procurar] = 1;
-        bloco_procurar = fat[temp]; //quando temp = 2, nao acontece nada de ruim
-      }
-      dir[i].first_block = 1;
-	
-	/*escrever o bl_write. Corrigido em relação a primeria entrega*/ 
-	escreve_disco();
-  	escreve_dir_disco();
-    
-	  return 1;
+  for (;;) {
+    cluster = proximo_bit(livres_dica, 1, clusters_imagem);
+    if (cluster == clusters_imagem) {
+      cluster = proximo_bit(0, 1, livres_dica);
+    }
+    if (cluster < clusters_imagem && (livres_mapa[cluster / 64] >> (cluster % 64)) & 1) {
+      break;
+    }
+    //nenhum livre nos setores já lidos: lê mais um setor da FAT
+    if (!fat_carrega_mais()) {
+      conta_busca(antes);
+      return -1;
     }
   }
-
-  printf("Erro! Arquivo não encontrado!\n");
-
-  return 0;
+  conta_busca(antes);
+  livres_dica = cluster + 1 < clusters_imagem ? cluster + 1 : 0;
+  return cluster;
 }
 
-// -------- PARTE 2 ------------------
-int fs_open(char *file_name, int mode) {
-  // Busca o arquivo no diretório
-  int arquivo_encontrado = -1;  // Variável para armazenar o índice do arquivo no diretório
-
-  // Percorre todas as entradas do diretório para procurar o arquivo pelo nome
-  for (int i = 0; i < DIRENTRIES; i++) {
-    if (!strcmp(dir[i].name, file_name)) {  // Se encontrar o arquivo, armazena seu índice
-      arquivo_encontrado = i;
-      break;
+/*
+ * Procura a partir da dica uma sequência de n clusters livres contíguos.
+ * Se não houver nenhuma desse tamanho nos setores da FAT já lidos, lê mais
+ * um e tenta de novo; por fim devolve a maior encontrada. O tamanho da
+ * sequência devolvida fica em *tam.
+ */
+int procura_extensao(int n, int *tam) {
+  int melhor, melhor_tam;
+  int faixas[2][2] = {{livres_dica, clusters_imagem}, {0, livres_dica}};
+
+  do {
+    melhor = -1;
+    melhor_tam = 0;
+    for (int f = 0; f < 2 && melhor_tam < n; f++) {
+      int c = faixas[f][0];
+      int limite = faixas[f][1];
+      while (c < limite && melhor_tam < n) {
+        int inicio = proximo_bit(c, 1, limite);
+        if (inicio == limite) {
+          break;
+        }
+        int fim = proximo_bit(inicio, 0, inicio + n < limite ? inicio + n : limite);
+        if (fim - inicio > melhor_tam) {
+          melhor = inicio;
+          melhor_tam = fim - inicio;
+        }
+        c = fim;
+      }
     }
+  } while (melhor_tam < n && fat_carrega_mais());
+  *tam = melhor_tam;
+  return melhor;
+}
+
+/* tira os clusters [inicio, inicio + n) do mapa de livres sem tocar na FAT */
+void reserva_clusters(int inicio, int n) {
+  for (int c = inicio; c < inicio + n; c++) {
+    livres_mapa[c / 64] &= ~(1ULL << (c % 64));
   }
+  livres_total -= n;
+}
 
-  // Verifica se o arquivo foi encontrado no diretório
-  if (arquivo_encontrado == -1) {
-    printf("Erro! O arquivo não foi encontrado!\n");  // Mostra mensagem de erro se o arquivo não foi encontrado
-    return -1;  // Retorna -1 indicando falha
+/* devolve ao mapa de livres os clusters [inicio, fim) reservados e não usados */
+void libera_reserva(int inicio, int fim) {
+  for (int c = inicio; c < fim; c++) {
+    livres_mapa[c / 64] |= 1ULL << (c % 64);
   }
+  livres_total += fim - inicio;
+}
 
-  // Se o modo de abertura for para escrita (FS_W)
-  if (mode == FS_W) {
-    // Remove o arquivo existente e recria um novo com o mesmo nome
-    fs_remove(file_name);  // Remove o arquivo antigo
-    fs_create(file_name);  // Cria um novo arquivo com tamanho zero
+/*
+ * Pré-aloca uma extensão para o arquivo, de preferência logo depois do seu
+ * último cluster para que ele continue contíguo na imagem.
+ */
+int reserva_extensao(arquivosAbertos *arquivo) {
+  int inicio, tam;
+  int seguinte = arquivo->fim + 1;
+  long antes = palavras_varridas;
 
-    // Procura novamente o arquivo recém-criado no diretório
-    for (int i = 0; i < DIRENTRIES; i++) {
-      if (!strcmp(dir[i].name, file_name)) {
-        arquivo_encontrado = i;  // Atualiza o índice para o arquivo recriado
-        break;
-      }
-    }
+  if (livres_total == 0) {
+    return 0;
+  }
+  int limite = seguinte + arquivo->reservaTam < clusters_imagem ? seguinte + arquivo->reservaTam : clusters_imagem;
+  //os setores da FAT logo depois do arquivo precisam estar lidos para o mapa valer
+  for (int c = seguinte; c < limite; c += FATPORSETOR - c % FATPORSETOR) {
+    fat_le(c);
+  }
+  if (seguinte < clusters_imagem && (livres_mapa[seguinte / 64] >> (seguinte % 64)) & 1) {
+    inicio = seguinte;
+    tam = proximo_bit(seguinte, 0, limite) - inicio;
   } else {
-    // Caso o modo seja de leitura, carrega o primeiro bloco do arquivo para a memória
-    bl_read(dir[arquivo_encontrado].first_block, listaArquivos[arquivo_encontrado].memoria);
+    inicio = procura_extensao(arquivo->reservaTam, &tam);
   }
+  conta_busca(antes);
+  //nenhum cluster livre encontrado: disco cheio, sem mexer na reserva do arquivo
+  if (inicio < 0 || tam == 0) {
+    return 0;
+  }
+  reserva_clusters(inicio, tam);
+  arquivo->reservaInicio = inicio;
+  arquivo->reservaFim = inicio + tam;
+  livres_dica = arquivo->reservaFim < clusters_imagem ? arquivo->reservaFim : 0;
+
+  //arquivos que continuam crescendo ganham reservas cada vez maiores; a
+  //reserva exata de importa passa a pedir só o que ainda falta
+  if (arquivo->reservaExata) {
+    arquivo->reservaTam = arquivo->reservaTam > tam ? arquivo->reservaTam - tam : 1;
+  } else if (arquivo->reservaTam < prealoca_max) {
+    arquivo->reservaTam *= 2;
+  }
+  return 1;
+}
 
-  // Configura as informações iniciais para o arquivo aberto
-  arquivosAbertos *arquivo = &listaArquivos[arquivo_encontrado];
-  arquivo->primeiro = dir[arquivo_encontrado].first_block;  // Armazena o primeiro bloco do arquivo
-  arquivo->fim = arquivo->primeiro;  // Inicializa o bloco final como o primeiro bloco
-  arquivo->categoria = mode;  // Define o modo de abertura (leitura ou escrita)
-  arquivo->ocupado = 1;  // Marca o arquivo como "ocupado" (aberto)
-  arquivo->dirIndex = arquivo_encontrado;  // Armazena o índice do arquivo no diretório
-  arquivo->posicaoEscrita = 0;  // Inicializa a posição de escrita no arquivo
-  arquivo->posicaoLeitura = 0;  // Inicializa a posição de leitura no arquivo
-  arquivo->totalLido = 0;  // Inicializa o total de bytes lidos como zero
-
-  return arquivo_encontrado;  // Retorna o índice do arquivo no diretório
+/* próximo cluster da cadeia de um arquivo sendo escrito, conforme o modo de alocação */
+int proximo_cluster(arquivosAbertos *arquivo) {
+  if (modo_alocacao == FS_ALLOC_CLUSTER) {
+    return aloca_cluster();
+  }
+  if (arquivo->reservaInicio == arquivo->reservaFim && !reserva_extensao(arquivo)) {
+    return -1;
+  }
+  return arquivo->reservaInicio++;
 }
 
+/*
+ * Diário de metadados. Fica em setores contíguos logo depois da FAT. O
+ * superbloco, no setor 0, traz além da geometria a sequência da primeira
+ * transação válida, o total de clusters livres e a dica do alocador, assim
+ * fs_init não precisa ler a FAT inteira. Os setores do diário guardam as
+ * transações, cada uma um cabeçalho com sequência,
+ * número de registros e soma de verificação seguido dos registros. Um
+ * registro é o novo valor de uma entrada da FAT ou do diretório. Uma
+ * transação só vale se a sequência for a esperada e a soma conferir, assim
+ * uma gravação interrompida é descartada ao refazer o diário em fs_init.
+ * Quando o diário enche, o ponto de controle grava nos lugares definitivos
+ * só os setores sujos e recomeça o diário.
+ */
+#define DIARIOSETORES 256
+#define DIARIO_MAGICO 0x4a535352u  // "RSSJ"
+#define DIARIO_FAT 1
+#define DIARIO_DIR 2
+
+typedef struct {
+  unsigned int magico;
+  unsigned int sequencia;
+  unsigned int bytes;  // tamanho dos registros que seguem o cabeçalho
+  unsigned int soma;
+} diario_cabecalho;
+
+/* o total de livres só vale se nenhum ponto de controle foi interrompido */
+#define SUPERBLOCO_MAGICO 0x32425352u     // "RSB2"
+#define SUPERBLOCO_MAGICO_16 0x42535352u  // "RSSB", imagens com a FAT de 16 bits
+#define SB_VALIDO 1
+#define SB_EM_CONTROLE 2
 
-int fs_close(int file) {
-  // Obtém a estrutura do arquivo correspondente ao descritor fornecido
-  arquivosAbertos *arquivo = &listaArquivos[file];
+typedef struct {
+  unsigned int magico;
+  unsigned int sequencia;  // primeira transação válida do diário
+  int livres;              // entradas livres na FAT gravada nos lugares definitivos
+  int dica;                // onde o alocador retoma a busca
+  int estado;
+  int tam_cluster;         // bytes por cluster
+  int clusters;            // clusters da imagem, todos com entrada na FAT
+  int fat_inicio;          // primeiro setor da FAT
+  int fat_setores;
+  int diario_inicio;       // primeiro setor do diário
+  int diario_setores;      // 0 se a imagem não tem diário
+  int dir_inicio;          // primeiro cluster do diretório
+} superbloco;
 
-  // Verifica se o arquivo foi aberto para escrita (FS_W)
-  if (arquivo->categoria == FS_W) {
-    // Grava qualquer conteúdo restante no buffer para o bloco final do arquivo
-    bl_write(arquivo->fim, arquivo->memoria);
+typedef struct {
+  int tipo;
+  int indice;
+  unsigned int valor;  // novo valor da FAT; registros do diretório trazem a entrada em seguida
+} diario_registro;
 
-    // Atualiza o tamanho do arquivo no diretório com a quantidade de bytes escritos
-    dir[arquivo->dirIndex].size += arquivo->posicaoEscrita;
+int diario_inicio = 0;       // primeiro setor do diário
+int diario_tam = 0;          // setores do diário, 0 se a imagem não tem diário
+int diario_pos = 0;          // próximo setor livre do diário
+unsigned int diario_seq = 1; // sequência da próxima transação
+unsigned int diario_primeira = 1;  // sequência da primeira transação desde o ponto de controle
 
-    // Salva o diretório atualizado no disco
-    escreve_dir_disco();
+/*
+ * Entradas alteradas desde a última transação, cada uma anotada uma vez.
+ * Mais entradas da FAT do que cabem no diário não são anotadas: a
+ * transação vira um ponto de controle, que grava as páginas sujas.
+ */
+#define DIARIOREGISTROS (DIARIOSETORES * SECTORSIZE / sizeof(diario_registro))
+
+unsigned char *diario_fat_marca = NULL;  // um bit por cluster
+int diario_fat[DIARIOREGISTROS];
+int diario_fat_n = 0;
+int diario_transbordou = 0;
+char *diario_dir_marca = NULL;  // um por entrada do diretório
+int *diario_dir = NULL;
+int diario_dir_n = 0;
+
+/* commit em grupo: transações gravadas e quantas delas já estão garantidas no disco */
+long diario_gravadas = 0;
+long diario_duraveis = 0;
+pthread_mutex_t trava_confirmacao = PTHREAD_MUTEX_INITIALIZER;
+
+void diario_anota_fat(int cluster) {
+  if (diario_tam && !(diario_fat_marca[cluster / 8] & (1 << (cluster % 8)))) {
+    if (diario_fat_n == (int) DIARIOREGISTROS) {
+      diario_transbordou = 1;
+      return;
+    }
+    diario_fat_marca[cluster / 8] |= 1 << (cluster % 8);
+    diario_fat[diario_fat_n++] = cluster;
   }
+}
 
-  // Verifica se o arquivo realmente está aberto (ocupado)
-  if (!arquivo->ocupado) {
-    // Se o arquivo não estiver aberto, exibe uma mensagem de erro e retorna -1
-    printf("Erro: arquivo com file %d não está aberto.\n", file);
-    return -1;
+void diario_anota_dir(int entrada) {
+  if (diario_tam && !diario_dir_marca[entrada]) {
+    diario_dir_marca[entrada] = 1;
+    diario_dir[diario_dir_n++] = entrada;
   }
-
-  // Marca o arquivo como fechado (não ocupado)
-  arquivo->ocupado = 0;
-
-  // Retorna 0 indicando que o fechamento foi bem-sucedido
-  return 0;
 }
 
-
-int fs_write(char *buffer, int size, int file) {
-  // Obtém a estrutura do arquivo que está sendo escrito
-  arquivosAbertos *arquivo = &listaArquivos[file];
-
-  // Verifica se o arquivo está aberto para escrita e se está em uso
-  if (arquivo->categoria != FS_W || !arquivo->ocupado) {
-    return -1;  // Retorna -1 se o arquivo não estiver no modo de escrita ou não estiver aberto
+/* esquece as anotações, já gravadas no diário ou nos lugares definitivos */
+void diario_limpa_anotacoes() {
+  for (int k = 0; k < diario_fat_n; k++) {
+    diario_fat_marca[diario_fat[k] / 8] = 0;
   }
+  for (int k = 0; k < diario_dir_n; k++) {
+    diario_dir_marca[diario_dir[k]] = 0;
+  }
+  diario_fat_n = diario_dir_n = 0;
+  diario_transbordou = 0;
+}
 
-  // Loop para escrever os dados do buffer no arquivo
-  for (int i = 0; i < size; i++) {
-    // Escreve um byte do buffer no local atual de escrita do arquivo
-    arquivo->memoria[arquivo->posicaoEscrita++] = buffer[i];
-
-    // Verifica se atingiu o limite do bloco (tamanho do cluster)
-    if (arquivo->posicaoEscrita == CLUSTERSIZE) {
-      // Grava o conteúdo atual do buffer no disco no bloco final do arquivo
-      bl_write(arquivo->fim, arquivo->memoria);
-
-      // Procura por um novo bloco livre na FAT (File Allocation Table)
-      int novoBloco = -1;
-      for (int j = DIRINDEX + 1; j < FATCLUSTERS; j++) {
-        if (fat[j] == 1) {  // Se encontrar um bloco livre (valor 1 na FAT)
-          novoBloco = j;    // Atribui esse bloco como o novo bloco
-          break;            // Encerra a busca
-        }
+/*
+ * Toda alteração da FAT passa por aqui para marcar a página como suja. O mapa
+ * de livres é atualizado pelo seu próprio bit, assim um cluster reservado
+ * (bit zerado mas ainda 1 na FAT) não é descontado duas vezes.
+ */
+void fat_set(int cluster, unsigned int valor) {
+  unsigned int antigo = fat_le(cluster);
+  if (antigo != valor) {
+    if (cluster < clusters_imagem) {
+      fat_livres += (valor == 1) - (antigo == 1);
+      unsigned long long bit = 1ULL << (cluster % 64);
+      if (valor == 1 && !(livres_mapa[cluster / 64] & bit)) {
+        livres_mapa[cluster / 64] |= bit;
+        livres_total++;
+      } else if (valor != 1 && (livres_mapa[cluster / 64] & bit)) {
+        livres_mapa[cluster / 64] &= ~bit;
+        livres_total--;
       }
-
-      // Atualiza a FAT com o novo bloco alocado
-      fat[arquivo->fim] = novoBloco;
-      arquivo->fim = novoBloco;  // Atualiza o bloco final do arquivo
-      arquivo->posicaoEscrita = 0;  // Reinicializa a posição de escrita para o novo bloco
-      dir[arquivo->dirIndex].size += CLUSTERSIZE;  // Atualiza o tamanho do arquivo no diretório
     }
+    int s = cluster / FATPORSETOR;
+    fat_pagina[s][cluster % FATPORSETOR] = valor;
+    if (!fat_sujo[s]) {
+      fat_sujo[s] = 1;
+      fat_sujos++;
+    }
+    diario_anota_fat(cluster);
   }
+}
 
-  // Marca o bloco final como o último bloco usado (valor 2 na FAT)
-  fat[arquivo->fim] = 2;
+/* marca como sujo o setor do diretório que contém a entrada */
+void dir_marca(int entrada) {
+  dir_sujo[entrada / ENTRADASSETOR] = 1;
+  diario_anota_dir(entrada);
+}
 
-  // Escreve as atualizações no disco
-  escreve_disco();
-  escreve_dir_disco();
+/*
+ * Índice em memória do diretório: tabela hash nome -> entrada, encadeada
+ * por entrada, e lista das entradas livres. Só as entradas em uso ficam
+ * na tabela. É montado em fs_init/fs_format e mantido por create/remove;
+ * a tabela dobra de tamanho junto com o diretório.
+ */
+int *dir_hash = NULL;
+int dir_baldes = 0;          // potência de 2, pelo menos dir_entradas
+int *dir_hprox = NULL;
+int dir_livre;
+int *dir_livre_prox = NULL;
+
+unsigned int hash_nome(char *nome) {
+  //FNV-1a
+  unsigned int h = 2166136261u;
+  for (unsigned int i = 0; i < sizeof(dir[0].name) && nome[i]; i++) {
+    h = (h ^ (unsigned char) nome[i]) * 16777619u;
+  }
+  return h & (dir_baldes - 1);
+}
 
-  return size;  // Retorna o número de bytes que foram escritos
+int dir_busca(char *nome) {
+  int i = dir_hash[hash_nome(nome)];
+  while (i != -1 && strcmp(dir[i].name, nome)) {
+    i = dir_hprox[i];
+  }
+  return i;
 }
 
-int fs_read(char *buffer, int size, int file) {
-  // Obtém a estrutura de arquivos abertos para o arquivo fornecido
-  arquivosAbertos *arquivo = &listaArquivos[file];
+void dir_indexa(int entrada) {
+  unsigned int h = hash_nome(dir[entrada].name);
+  dir_hprox[entrada] = dir_hash[h];
+  dir_hash[h] = entrada;
+}
 
-  // Verifica se o arquivo está aberto no modo de leitura e se está realmente em uso
-  if (arquivo->categoria != FS_R || !arquivo->ocupado) {
-    printf("Erro! ");  // Mostra uma mensagem de erro se o arquivo não está em modo leitura ou não está aberto
-    return -1;          // Retorna -1 indicando erro
+void dir_desindexa(int entrada) {
+  int *p = &dir_hash[hash_nome(dir[entrada].name)];
+  while (*p != entrada) {
+    p = &dir_hprox[*p];
   }
+  *p = dir_hprox[entrada];
+}
 
-  int lidos = 0;          // Variável que conta quantos bytes foram lidos
-  int blocoAtual = arquivo->primeiro;  // Define o bloco atual como o primeiro bloco do arquivo
+/* tira uma entrada da lista de livres, -1 se o diretório está cheio */
+int dir_pega_livre() {
+  int entrada = dir_livre;
+  if (entrada != -1) {
+    dir_livre = dir_livre_prox[entrada];
+  }
+  return entrada;
+}
 
-  // Loop para ler até "size" bytes ou até o total de bytes lidos ser igual ao tamanho do arquivo
-  for (int i = 0; i < size && arquivo->totalLido < dir[arquivo->dirIndex].size; i++) {
-    buffer[i] = arquivo->memoria[arquivo->posicaoLeitura++];  // Lê um byte do buffer para o destino
-    arquivo->totalLido++;  // Atualiza o total de bytes lidos
+void dir_devolve(int entrada) {
+  dir_livre_prox[entrada] = dir_livre;
+  dir_livre = entrada;
+}
 
-    // Se o índice de leitura atingiu o tamanho máximo do bloco, carrega o próximo bloco
-    if (arquivo->posicaoLeitura == CLUSTERSIZE) {
-      blocoAtual = fat[blocoAtual];  // Acessa o próximo bloco através da FAT (File Allocation Table)
-      bl_read(blocoAtual, arquivo->memoria);  // Lê o conteúdo do novo bloco para o buffer
-      arquivo->posicaoLeitura = 0;  // Reinicializa o índice de leitura para o novo bloco
+void dir_reconstroi_indice() {
+  int baldes = 1;
+  while (baldes < dir_entradas) {
+    baldes *= 2;
+  }
+  if (baldes != dir_baldes) {
+    free(dir_hash);
+    dir_hash = malloc(sizeof(int) * baldes);
+    dir_baldes = baldes;
+  }
+  for (int h = 0; h < dir_baldes; h++) {
+    dir_hash[h] = -1;
+  }
+  dir_livre = -1;
+  //percorre de trás para frente para a lista de livres começar pela menor entrada
+  for (int i = dir_entradas - 1; i >= 0; i--) {
+    if (dir[i].used == 1) {
+      dir_indexa(i);
+    } else {
+      dir_devolve(i);
     }
-
-    lidos++;  // Incrementa o contador de bytes lidos
   }
+}
 
-  return lidos;  // Retorna o número total de bytes lidos com sucesso
+/* ajusta os vetores em memória do diretório para n clusters */
+int dir_redimensiona(int n) {
+  int entradas = n * ENTRADASCLUSTER;
+  dir_entry *novo_dir = realloc(dir, sizeof(dir_entry) * entradas);
+  int *novo_clusters = realloc(dir_clusters, sizeof(int) * n);
+  char *novo_sujo = realloc(dir_sujo, n * setores_cluster);
+  int *novo_hprox = realloc(dir_hprox, sizeof(int) * entradas);
+  int *novo_livre = realloc(dir_livre_prox, sizeof(int) * entradas);
+  int *novo_abertos = realloc(dir_abertos, sizeof(int) * entradas);
+  char *nova_escrita = realloc(dir_escrita, entradas);
+  char *nova_marca = realloc(diario_dir_marca, entradas);
+  int *novo_diario = realloc(diario_dir, sizeof(int) * entradas);
+
+  if (novo_dir) dir = novo_dir;
+  if (novo_clusters) dir_clusters = novo_clusters;
+  if (novo_sujo) dir_sujo = novo_sujo;
+  if (novo_hprox) dir_hprox = novo_hprox;
+  if (novo_livre) dir_livre_prox = novo_livre;
+  if (novo_abertos) dir_abertos = novo_abertos;
+  if (nova_escrita) dir_escrita = nova_escrita;
+  if (nova_marca) diario_dir_marca = nova_marca;
+  if (novo_diario) diario_dir = novo_diario;
+  if (!novo_dir || !novo_clusters || !novo_sujo || !novo_hprox || !novo_livre
+      || !novo_abertos || !nova_escrita || !nova_marca || !novo_diario) {
+    printf("Erro! Sem memória para o diretório\n");
+    return 0;
+  }
+  for (int i = dir_entradas; i < entradas; i++) {
+    dir_abertos[i] = 0;
+    dir_escrita[i] = 0;
+    diario_dir_marca[i] = 0;
+  }
+  for (int k = dir_nclusters * setores_cluster; k < n * setores_cluster; k++) {
+    dir_sujo[k] = 0;
+  }
+  dir_entradas = entradas;
+  dir_nclusters = n;
+  return 1;
+}
+
+void dir_limpa(int entrada) {
+  dir[entrada].used = 0;
+  memset(dir[entrada].name, ' ', 25*sizeof(char)); //inicializa o nome da string com " " em todas as celulas.
+  dir[entrada].first_block = 0;
+  dir[entrada].size = 0;
+}
+
+/* acrescenta um cluster ao fim da cadeia do diretório */
+int dir_cresce() {
+  int cluster = aloca_cluster();
+  int ultimo = dir_clusters[dir_nclusters - 1];
+
+  if (cluster == -1) {
+    return 0;
+  }
+  if (!dir_redimensiona(dir_nclusters + 1)) {
+    return 0;
+  }
+  fat_set(ultimo, cluster);
+  fat_set(cluster, 4);
+  dir_clusters[dir_nclusters - 1] = cluster;
+  for (int i = dir_entradas - ENTRADASCLUSTER; i < dir_entradas; i++) {
+    dir_limpa(i);
+    dir_marca(i);
+  }
+  dir_reconstroi_indice();
+  return 1;
+}
+
+/* estrutura do descritor file, NULL se não estiver aberto */
+arquivosAbertos *pega_arquivo(int file) {
+  if (file < 0 || file >= MAXOPENFILES || !descritores[file].ocupado) {
+    return NULL;
+  }
+  return &descritores[file];
+}
+
+/* tira um descritor da lista de livres, -1 se a tabela estiver cheia */
+int descritor_pega() {
+  pthread_mutex_lock(&trava_tabela);
+  int file = descritor_livre;
+  if (file != -1) {
+    descritor_livre = descritores[file].proxLivre;
+  } else if (descritores_novos < MAXOPENFILES) {
+    file = descritores_novos++;
+  }
+  pthread_mutex_unlock(&trava_tabela);
+  return file;
+}
+
+void descritor_devolve(int file) {
+  pthread_mutex_lock(&trava_tabela);
+  descritores[file].proxLivre = descritor_livre;
+  descritor_livre = file;
+  pthread_mutex_unlock(&trava_tabela);
+}
+
+/* buffer de um cluster para a memoria de um descritor, reaproveitado se possível */
+char *buffer_pega() {
+  pthread_mutex_lock(&trava_tabela);
+  char *buffer = buffers_livres;
+  if (buffer != NULL) {
+    buffers_livres = *(char **) buffer;
+  }
+  pthread_mutex_unlock(&trava_tabela);
+  return buffer != NULL ? buffer : malloc(tam_cluster);
+}
+
+void buffer_devolve(char *buffer) {
+  pthread_mutex_lock(&trava_tabela);
+  *(char **) buffer = buffers_livres;
+  buffers_livres = buffer;
+  pthread_mutex_unlock(&trava_tabela);
+}
+
+/* acrescenta um cluster ao fim do mapa lógico -> físico do arquivo */
+int mapa_acrescenta(arquivosAbertos *arquivo, int cluster) {
+  if (arquivo->mapaTam == arquivo->mapaCap) {
+    int cap = arquivo->mapaCap ? arquivo->mapaCap * 2 : 16;
+    int *novo = realloc(arquivo->mapa, sizeof(int) * cap);
+    if (novo == NULL) {
+      return 0;
+    }
+    arquivo->mapa = novo;
+    arquivo->mapaCap = cap;
+  }
+  arquivo->mapa[arquivo->mapaTam++] = cluster;
+  return 1;
+}
+
+/* percorre a cadeia do arquivo uma vez, assim achar o cluster de um deslocamento é O(1) */
+int monta_mapa(arquivosAbertos *arquivo) {
+  int ok = 1;
+
+  arquivo->mapa = NULL;
+  arquivo->mapaTam = arquivo->mapaCap = 0;
+  pthread_mutex_lock(&trava_fat);
+  for (unsigned int c = arquivo->primeiro; ok && c != 2; c = fat_le(c)) {
+    ok = mapa_acrescenta(arquivo, c);
+  }
+  pthread_mutex_unlock(&trava_fat);
+  return ok;
+}
+
+/* tamanho do arquivo aberto, contando o que ainda está no bloco em memória */
+long long tamanho_atual(arquivosAbertos *arquivo) {
+  if (arquivo->categoria == FS_R) {
+    return dir[arquivo->dirIndex].size;
+  }
+  return (long long) (arquivo->mapaTam - 1) * tam_cluster + arquivo->posicaoEscrita + arquivo->pendenteTam;
+}
+
+/* funções para escrita das estruturas de dados no disco */
+void escreve_disco(){
+  //grava somente as páginas da FAT que mudaram, cada sequência de setores sujos numa só escrita
+  char *paginas[FATLEITURA];
+  for (int sector = 0; sector < fat_setores; ) {
+    int fim = sector;
+    while (fim < fat_setores && fat_sujo[fim] && fim - sector < FATLEITURA) {
+      paginas[fim - sector] = (char *) fat_pagina[fim];
+      fat_sujo[fim++] = 0;
+    }
+    if (fim > sector) {
+      bl_writev(fat_inicio + sector, paginas, fim - sector);
+      setores_meta_gravados += fim - sector;
+      fat_sujos -= fim - sector;
+      sector = fim;
+    } else {
+      sector++;
+    }
+  }
+}
+
+/* setor da imagem onde fica o setor q do diretório */
+int dir_setor(int q) {
+  return dir_clusters[q / setores_cluster] * setores_cluster + q % setores_cluster;
+}
+
+void escreve_dir_disco(){
+  //cada setor do diretório guarda exatamente ENTRADASSETOR entradas;
+  //setores sujos vizinhos no diretório e na imagem vão numa só escrita
+  int setores = dir_nclusters * setores_cluster;
+  for (int q = 0; q < setores; ) {
+    int fim = q;
+    while (fim < setores && dir_sujo[fim] && (fim == q || dir_setor(fim) == dir_setor(fim - 1) + 1)) {
+      dir_sujo[fim++] = 0;
+    }
+    if (fim > q) {
+      bl_write_range(dir_setor(q), fim - q, (char *) &dir[q * ENTRADASSETOR]);
+      setores_meta_gravados += fim - q;
+      q = fim;
+    } else {
+      q++;
+    }
+  }
+}
+
+unsigned int diario_soma(char *dados, int n, unsigned int sequencia) {
+  //FNV-1a sobre a sequência e os registros
+  unsigned int h = 2166136261u ^ sequencia;
+  for (int i = 0; i < n; i++) {
+    h = (h ^ (unsigned char) dados[i]) * 16777619u;
+  }
+  return h;
+}
+
+/* o diário ocupa tam setores a partir de inicio; começa sem anotações */
+void diario_inicia(int inicio, int tam) {
+  diario_inicio = inicio;
+  diario_tam = tam;
+  diario_pos = 0;
+  free(diario_fat_marca);
+  diario_fat_marca = calloc((clusters_imagem + 7) / 8, 1);
+  diario_fat_n = diario_dir_n = 0;
+  diario_transbordou = 0;
+}
+
+void superbloco_grava(int estado) {
+  char setor[SECTORSIZE];
+  superbloco *sb = (superbloco *) setor;
+
+  memset(setor, 0, sizeof(setor));
+  sb->magico = SUPERBLOCO_MAGICO;
+  sb->sequencia = diario_primeira;
+  sb->livres = fat_livres;
+  sb->dica = livres_dica;
+  sb->estado = estado;
+  sb->tam_cluster = tam_cluster;
+  sb->clusters = clusters_imagem;
+  sb->fat_inicio = fat_inicio;
+  sb->fat_setores = fat_setores;
+  sb->diario_inicio = diario_inicio;
+  sb->diario_setores = diario_tam;
+  sb->dir_inicio = dir_inicio;
+  bl_write(0, setor);
+  setores_meta_gravados++;
+}
+
+/* recomeça o diário vazio: as transações válidas começam em diario_seq */
+void diario_recomeca() {
+  diario_primeira = diario_seq;
+  diario_pos = 0;
+  superbloco_grava(SB_VALIDO);
+}
+
+/*
+ * Ponto de controle: grava os setores sujos da FAT e do diretório nos seus
+ * lugares e, depois que chegaram ao disco, recomeça o diário vazio. Antes
+ * o superbloco é marcado, porque uma queda no meio deixaria a FAT gravada
+ * à frente do total de livres. O primeiro bl_sync é a barreira entre o
+ * diário (e o superbloco marcado) e os lugares definitivos: nada destes é
+ * sobrescrito antes daqueles estarem no disco.
+ */
+void diario_ponto_controle() {
+  if (diario_tam) {
+    superbloco_grava(SB_EM_CONTROLE);
+    bl_sync();
+  }
+  escreve_disco();
+  escreve_dir_disco();
+  diario_limpa_anotacoes();
+  if (diario_tam) {
+    bl_sync();
+    diario_recomeca();
+  }
+}
+
+/* grava as entradas anotadas como uma transação no fim do diário */
+void diario_grava() {
+  static char *transacao = NULL;
+  static int capacidade = 0;
+
+  //imagem sem diário: grava os setores sujos direto nos seus lugares
+  if (!diario_tam) {
+    escreve_disco();
+    escreve_dir_disco();
+    __atomic_add_fetch(&diario_gravadas, 1, __ATOMIC_SEQ_CST);
+    return;
+  }
+  if (diario_fat_n + diario_dir_n == 0 && !diario_transbordou) {
+    __atomic_add_fetch(&diario_gravadas, 1, __ATOMIC_SEQ_CST);
+    return;
+  }
+
+  int bytes = diario_fat_n * sizeof(diario_registro)
+              + diario_dir_n * (sizeof(diario_registro) + sizeof(dir_entry));
+  int setores = (sizeof(diario_cabecalho) + bytes + SECTORSIZE - 1) / SECTORSIZE;
+  if (diario_pos + setores > diario_tam || diario_transbordou || fat_sujos > FATPAGINAS / 2) {
+    //diário cheio ou páginas da FAT demais presas: o ponto de controle grava tudo o que estava anotado
+    diario_ponto_controle();
+    __atomic_add_fetch(&diario_gravadas, 1, __ATOMIC_SEQ_CST);
+    return;
+  }
+  if (setores * SECTORSIZE > capacidade) {
+    char *novo = realloc(transacao, setores * SECTORSIZE);
+    if (novo == NULL) {
+      diario_ponto_controle();
+      __atomic_add_fetch(&diario_gravadas, 1, __ATOMIC_SEQ_CST);
+      return;
+    }
+    transacao = novo;
+    capacidade = setores * SECTORSIZE;
+  }
+
+  char *p = transacao + sizeof(diario_cabecalho);
+  for (int k = 0; k < diario_fat_n; k++) {
+    diario_registro registro = {DIARIO_FAT, diario_fat[k], fat_le(diario_fat[k])};
+    memcpy(p, &registro, sizeof(registro));
+    p += sizeof(registro);
+  }
+  for (int k = 0; k < diario_dir_n; k++) {
+    diario_registro registro = {DIARIO_DIR, diario_dir[k], 0};
+    memcpy(p, &registro, sizeof(registro));
+    memcpy(p + sizeof(registro), &dir[diario_dir[k]], sizeof(dir_entry));
+    p += sizeof(registro) + sizeof(dir_entry);
+  }
+  memset(p, 0, transacao + setores * SECTORSIZE - p);
+
+  diario_cabecalho *cabecalho = (diario_cabecalho *) transacao;
+  cabecalho->magico = DIARIO_MAGICO;
+  cabecalho->sequencia = diario_seq;
+  cabecalho->bytes = bytes;
+  cabecalho->soma = diario_soma(transacao + sizeof(diario_cabecalho), bytes, diario_seq);
+  bl_write_range(diario_inicio + diario_pos, setores, transacao);
+  setores_meta_gravados += setores;
+  diario_pos += setores;
+  diario_seq++;
+  diario_limpa_anotacoes();
+  //só conta depois de gravada: diario_confirma lê o contador sem trava_fat
+  __atomic_add_fetch(&diario_gravadas, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Garante no disco tudo o que foi gravado até a transação n. Quem chega
+ * enquanto outra thread sincroniza espera por ela e, se a sua transação já
+ * estava gravada quando aquele bl_sync começou, volta sem sincronizar de novo.
+ */
+void diario_confirma(long n) {
+  pthread_mutex_lock(&trava_confirmacao);
+  if (diario_duraveis < n) {
+    long ate = __atomic_load_n(&diario_gravadas, __ATOMIC_SEQ_CST);
+    bl_sync();
+    diario_duraveis = ate;
+  }
+  pthread_mutex_unlock(&trava_confirmacao);
+}
+
+/*
+ * Lê do diário as transações válidas a partir da sequência dada, uma por
+ * vez, até a primeira que não confere. Devolve o buffer com elas, de
+ * *bytes bytes, ou NULL se não há nenhuma.
+ */
+char *diario_le(unsigned int sequencia, int *bytes) {
+  char *transacoes = NULL;
+  int pos = 0;
+
+  *bytes = 0;
+  while (pos < diario_tam) {
+    char *novo = realloc(transacoes, *bytes + SECTORSIZE);
+    if (novo == NULL) {
+      break;
+    }
+    transacoes = novo;
+    char *t = transacoes + *bytes;
+    diario_cabecalho *cabecalho = (diario_cabecalho *) t;
+    bl_read(diario_inicio + pos, t);
+    if (cabecalho->magico != DIARIO_MAGICO || cabecalho->sequencia != sequencia
+        || cabecalho->bytes > (diario_tam - pos) * SECTORSIZE - sizeof(diario_cabecalho)) {
+      break;
+    }
+    int setores = (sizeof(diario_cabecalho) + cabecalho->bytes + SECTORSIZE - 1) / SECTORSIZE;
+    if (setores > 1) {
+      novo = realloc(transacoes, *bytes + setores * SECTORSIZE);
+      if (novo == NULL) {
+        break;
+      }
+      transacoes = novo;
+      t = transacoes + *bytes;
+      cabecalho = (diario_cabecalho *) t;
+      bl_read_range(diario_inicio + pos + 1, setores - 1, t + SECTORSIZE);
+    }
+    if (cabecalho->soma != diario_soma(t + sizeof(diario_cabecalho), cabecalho->bytes, sequencia)) {
+      break;
+    }
+    *bytes += setores * SECTORSIZE;
+    pos += setores;
+    sequencia++;
+  }
+  if (*bytes == 0) {
+    free(transacoes);
+    return NULL;
+  }
+  return transacoes;
+}
+
+/*
+ * Refaz as transações lidas por diario_le, aplicando só os registros do tipo pedido: a FAT é
+ * refeita antes de carregar o diretório, que pode ter ganho clusters.
+ * Devolve quantas transações eram válidas.
+ */
+int diario_refaz(char *transacoes, int limite, unsigned int sequencia, int tipo) {
+  int pos = 0;
+  int n = 0;
+
+  while (pos + (int) sizeof(diario_cabecalho) <= limite) {
+    diario_cabecalho *cabecalho = (diario_cabecalho *) (transacoes + pos);
+    char *p = transacoes + pos + sizeof(diario_cabecalho);
+    if (cabecalho->magico != DIARIO_MAGICO || cabecalho->sequencia != sequencia
+        || cabecalho->bytes > limite - pos - sizeof(diario_cabecalho)
+        || cabecalho->soma != diario_soma(p, cabecalho->bytes, sequencia)) {
+      break;
+    }
+    char *fim = p + cabecalho->bytes;
+    while (p + sizeof(diario_registro) <= fim) {
+      diario_registro registro;
+      memcpy(&registro, p, sizeof(registro));
+      p += sizeof(registro);
+      if (registro.tipo == DIARIO_FAT && registro.indice >= 0 && registro.indice < clusters_imagem) {
+        if (tipo == DIARIO_FAT) {
+          fat_set(registro.indice, registro.valor);
+        }
+      } else if (registro.tipo == DIARIO_DIR && p + sizeof(dir_entry) <= fim) {
+        if (tipo == DIARIO_DIR && registro.indice >= 0 && registro.indice < dir_entradas) {
+          memcpy(&dir[registro.indice], p, sizeof(dir_entry));
+          dir_sujo[registro.indice / ENTRADASSETOR] = 1;
+        }
+        p += sizeof(dir_entry);
+      } else {
+        break;
+      }
+    }
+    pos += (sizeof(diario_cabecalho) + cabecalho->bytes + SECTORSIZE - 1) / SECTORSIZE * SECTORSIZE;
+    sequencia++;
+    n++;
+  }
+  return n;
+}
+
+/* grava os metadados sujos se a política atual pede sincronização neste evento */
+void sincroniza(int evento) {
+  if (evento >= politica_sync && !sync_adiado) {
+    pthread_mutex_lock(&trava_fat);
+    diario_grava();
+    long gravada = __atomic_load_n(&diario_gravadas, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&trava_fat);
+    diario_confirma(gravada);
+  }
+}
+
+
+int verifica_formatacao(){
+  if (!formatado) {
+    printf("sistema de arquivos não formatado\n");
+  }
+  return formatado;
+}
+
+/* há descritores abertos apontando para entradas do diretório */
+int ha_abertos() {
+  for (int k = 0; k < dir_entradas; k++) {
+    if (dir_abertos[k] > 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Adota a geometria de uma imagem e recalcula o que depende do tamanho do
+ * cluster. Os buffers guardados têm o tamanho do cluster antigo.
+ */
+void geometria(int tam, int clusters) {
+  if (tam != tam_cluster) {
+    pthread_mutex_lock(&trava_tabela);
+    while (buffers_livres != NULL) {
+      char *proximo = *(char **) buffers_livres;
+      free(buffers_livres);
+      buffers_livres = proximo;
+    }
+    pthread_mutex_unlock(&trava_tabela);
+  }
+  tam_cluster = tam;
+  setores_cluster = tam / SECTORSIZE;
+  clusters_imagem = clusters;
+  fat_setores = ((long) clusters * sizeof(unsigned int) + SECTORSIZE - 1) / SECTORSIZE;
+
+  ra_posicoes = RABYTES / tam < 4 ? 4 : RABYTES / tam;
+  if (ra_posicoes > RAMAX) {
+    ra_posicoes = RAMAX;
+  }
+  trecho_clusters = TRECHOBYTES / tam > 0 ? TRECHOBYTES / tam : 1;
+  prealoca_min = PREALOCA_MIN / tam > 0 ? PREALOCA_MIN / tam : 1;
+  prealoca_max = PREALOCA_MAX / tam > 0 ? PREALOCA_MAX / tam : 1;
+}
+
+int formata() {
+  //os arquivos abertos apontariam para clusters que deixam de existir
+  if (ha_abertos()) {
+    printf("Erro! Há arquivos abertos!\n");
+    return 0;
+  }
+
+  //a FAT cobre a imagem inteira
+  int k = tam_cluster_formatacao / SECTORSIZE;
+  int clusters = bl_size() / k;
+  geometria(tam_cluster_formatacao, clusters);
+
+  //superbloco, FAT e diário, se a imagem comportar, ocupam os primeiros clusters
+  int diario = bl_size() / 16 < DIARIOSETORES ? bl_size() / 16 : DIARIOSETORES;
+  if (diario < 2) {
+    diario = 0;
+  }
+  int reservados = (1 + fat_setores + diario + k - 1) / k;
+  if (reservados < 6) {
+    reservados = 6;
+  }
+  if (reservados >= clusters) {
+    printf("Erro! Imagem pequena demais para o sistema de arquivos\n");
+    formatado = 0;
+    return 0;
+  }
+  fat_inicio = 1;
+  dir_inicio = reservados;
+  diario_inicia(fat_inicio + fat_setores, diario);
+
+  //uma queda no meio deixa a imagem sem superbloco, e não com o antigo sobre a FAT nova
+  char setor[SECTORSIZE];
+  memset(setor, 0, sizeof(setor));
+  bl_write(0, setor);
+  bl_sync();
+
+  //inicializando FAT em trechos de FATLEITURA setores; o resto do último
+  //setor não corresponde a clusters
+  unsigned int *trecho = malloc(FATLEITURA * SECTORSIZE);
+  if (trecho == NULL) {
+    printf("Erro! Sem memória para formatar\n");
+    return 0;
+  }
+  for (int s = 0; s < fat_setores; s += FATLEITURA) {
+    int n = fat_setores - s < FATLEITURA ? fat_setores - s : FATLEITURA;
+    for (int j = 0; j < n * (int) FATPORSETOR; j++) {
+      int c = s * FATPORSETOR + j;
+      trecho[j] = c < dir_inicio ? 3 : c == dir_inicio ? 4 : c < clusters ? 1 : 3;
+    }
+    bl_write_range(fat_inicio + s, n, (char *) trecho);
+  }
+  free(trecho);
+
+  //inicializando Diretório com um único cluster
+  dir_nclusters = dir_entradas = 0;
+  if (!dir_redimensiona(1)) {
+    return 0;
+  }
+  dir_clusters[0] = dir_inicio;
+  for(int i=0;i<dir_entradas;i++){
+    dir_limpa(i);
+  }
+
+  //livres são todos os clusters depois do primeiro do diretório
+  livres_inicia();
+  for (int c = dir_inicio + 1; c < clusters; c++) {
+    livres_mapa[c / 64] |= 1ULL << (c % 64);
+  }
+  memset(fat_mapeado, 1, fat_setores);
+  livres_total = fat_livres = clusters - dir_inicio - 1;
+  dir_reconstroi_indice();
+
+  //escrever o diretório no disco e só então o superbloco
+  memset(dir_sujo, 1, setores_cluster);
+  escreve_dir_disco();
+
+  //transações de uma formatação anterior não podem casar com a nova sequência
+  diario_seq = (unsigned int) time(NULL) * 2654435761u;
+  bl_sync();
+  diario_recomeca();
+  formatado = 1;
+  return 1;
+}
+
+int inicia() {
+  char setor[SECTORSIZE];
+  superbloco sb;
+
+  //o superbloco no setor 0 diz se a imagem está formatada e a sua geometria
+  bl_read(0, setor);
+  memcpy(&sb, setor, sizeof(sb));
+  if (sb.magico != SUPERBLOCO_MAGICO) {
+    //as primeiras imagens tinham a FAT a partir do setor 0, com 3 nos 32 primeiros clusters
+    unsigned short *antiga = (unsigned short *) setor;
+    int i = 0;
+    while (i < 32 && antiga[i] == 3) {
+      i++;
+    }
+    if (i == 32 || sb.magico == SUPERBLOCO_MAGICO_16) {
+      printf("Erro! Imagem num formato antigo; crie uma imagem nova\n");
+      formatado = 0;
+      return 0;
+    }
+    //se disco não estiver formatado, formata ele
+    return formata();
+  }
+  if (sb.tam_cluster < CLUSTERSIZE_MIN || sb.tam_cluster > CLUSTERSIZE_MAX
+      || (sb.tam_cluster & (sb.tam_cluster - 1)) || sb.clusters <= sb.dir_inicio
+      || sb.dir_inicio < 6 || sb.fat_inicio < 1
+      || sb.fat_setores != (int) (((long) sb.clusters * sizeof(unsigned int) + SECTORSIZE - 1) / SECTORSIZE)
+      || sb.diario_setores < 0 || sb.diario_setores > DIARIOSETORES
+      || (long) sb.clusters * (sb.tam_cluster / SECTORSIZE) > bl_size()) {
+    printf("Erro! Superbloco inválido\n");
+    formatado = 0;
+    return 0;
+  }
+  if (sb.tam_cluster != tam_cluster && ha_abertos()) {
+    printf("Erro! Há arquivos abertos!\n");
+    return 0;
+  }
+  geometria(sb.tam_cluster, sb.clusters);
+  fat_inicio = sb.fat_inicio;
+  dir_inicio = sb.dir_inicio;
+  diario_inicia(sb.diario_inicio, sb.diario_setores);
+
+  //só o primeiro setor da FAT é lido agora, os outros quando forem usados
+  livres_inicia();
+  fat_carrega(0);
+
+  //o superbloco traz o total de livres; o diário é refeito sobre a FAT
+  //gravada, antes de seguir a cadeia do diretório
+  char *transacoes = NULL;
+  int bytes = 0;
+  int refeitas = 0;
+  int confiavel = 0;
+  if (diario_tam) {
+    confiavel = sb.estado == SB_VALIDO;
+    fat_livres = sb.livres;
+    transacoes = diario_le(sb.sequencia, &bytes);
+    refeitas = diario_refaz(transacoes, bytes, sb.sequencia, DIARIO_FAT);
+  }
+
+  //carrega a cadeia de clusters do diretório até o marcador de fim (4)
+  int n = 1;
+  for (unsigned int c = dir_inicio; fat_le(c) != 4; c = fat_le(c)) {
+    if (fat_le(c) <= (unsigned int) dir_inicio || fat_le(c) >= (unsigned int) clusters_imagem
+        || n > clusters_imagem) {
+      printf("Erro! Cadeia do diretório corrompida\n");
+      free(transacoes);
+      formatado = 0;
+      return 0;
+    }
+    n++;
+  }
+  dir_nclusters = dir_entradas = 0;
+  if (!dir_redimensiona(n)) {
+    free(transacoes);
+    formatado = 0;
+    return 0;
+  }
+  for (int k = 0, c = dir_inicio; k < n; k++, c = fat_le(c)) {
+    dir_clusters[k] = c;
+  }
+  //lê os trechos do diretório contíguos na imagem numa só leitura
+  for (int k = 0; k < n; ) {
+    int fim = k + 1;
+    while (fim < n && dir_clusters[fim] == dir_clusters[fim - 1] + 1) {
+      fim++;
+    }
+    le_clusters(dir_clusters[k], fim - k, (char *) &dir[k * ENTRADASCLUSTER]);
+    k = fim;
+  }
+  diario_refaz(transacoes, bytes, sb.sequencia, DIARIO_DIR);
+  free(transacoes);
+
+  //sem superbloco confiável a FAT inteira é lida para contar os livres
+  if (confiavel) {
+    livres_total = fat_livres;
+    livres_dica = sb.dica >= 0 && sb.dica < clusters_imagem ? sb.dica : 0;
+  } else {
+    livres_reconstroi();
+  }
+  dir_reconstroi_indice();
+  formatado = 1;
+
+  //leva o que foi refeito aos lugares definitivos e recomeça o diário
+  diario_primeira = sb.sequencia;
+  diario_seq = sb.sequencia + refeitas;
+  diario_pos = bytes / SECTORSIZE;
+  if (diario_tam && (refeitas || !confiavel)) {
+    diario_seq++;
+    diario_ponto_controle();
+  }
+
+  return 1;
+}
+
+int fs_init() {
+  pthread_mutex_lock(&trava_dir);
+  trava_todos();
+  int ok = inicia();
+  destrava_todos();
+  pthread_mutex_unlock(&trava_dir);
+  return ok;
+}
+
+int fs_format() {
+  long long inicio = traco_inicio();
+  pthread_mutex_lock(&trava_dir);
+  trava_todos();
+  int ok = formata();
+  destrava_todos();
+  pthread_mutex_unlock(&trava_dir);
+  traco_fim(TR_FORMAT, inicio, NULL, 0, -1, tam_cluster_formatacao, 0, ok);
+  return ok;
+}
+
+long long espaco_total() {
+  //verifica se esta formatado
+  if(!verifica_formatacao()){
+    return 0;
+  }
+
+  //o total de clusters livres é mantido pelo alocador, cada um tem tam_cluster bytes
+  pthread_mutex_lock(&trava_fat);
+  long long total_bytes = (long long) livres_total * tam_cluster;
+  pthread_mutex_unlock(&trava_fat);
+  return total_bytes;
+}
+
+//retorna o espaco livre no dispositivo (disco) em bytes.
+long long fs_free() {
+  long long inicio = traco_inicio();
+  long long livre = espaco_total();
+  traco_fim(TR_FREE, inicio, NULL, 0, -1, 0, 0, livre);
+  return livre;
+}
+
+// int fs_list(char *buffer, int size): Lista os arquivos do diretório, colocando a saída formatada em buffer. O formato é simples, um arquivo
+// por linha, seguido de seu tamanho e separado por dois tabs. Observe
+// que a sua função não deve escrever na tela.
+int lista_arquivos(char *buffer, int size) {
+  if(!verifica_formatacao()){
+    return 0;
+  }
+
+  //reseta o vetor buffer e apaga tudo que já estava escrito nele
+  memset(buffer, '\0', size);
+
+  //devolve 0 sem escrever na tela se o buffer não comporta a listagem
+  int tamanho_usado = 0;
+  int ok = 1;
+  pthread_mutex_lock(&trava_dir);
+  for(int i=0;i<dir_entradas && ok;i++){
+    if(dir[i].used == 1){
+      char temp[50];
+      int tam = snprintf(temp, sizeof(temp), "%-25s %lld    \n", dir[i].name, dir[i].size);
+      if(tamanho_usado + tam < size){
+        memcpy(buffer + tamanho_usado, temp, tam + 1);
+        tamanho_usado += tam;
+      }
+      else{
+        ok = 0;
+      } 
+    }
+  }
+  pthread_mutex_unlock(&trava_dir);
+  return ok;
+}
+
+int fs_list(char *buffer, int size) {
+  long long inicio = traco_inicio();
+  int ok = lista_arquivos(buffer, size);
+  traco_fim(TR_LIST, inicio, NULL, 0, -1, size, 0, ok);
+  return ok;
+}
+
+/*
+ * Cria a entrada e o primeiro cluster do arquivo. Quem chama sincroniza os
+ * metadados depois de soltar trava_dir, para o fdatasync do diário não
+ * prender o diretório.
+ */
+int cria_arquivo(char* file_name) {
+  if(!verifica_formatacao()){
+    return 0;
+  }
+
+  if(strlen(file_name) >= sizeof(dir[0].name)){
+    printf("Erro! Nome de arquivo muito longo\n");
+    return 0;
+  }
+
+  //verifica se ja tem arquivo com este nome
+  if(dir_busca(file_name) != -1){
+    printf("Erro! Ja existe um arquivo com esse nome\n");;
+    return 0;
+  }
+
+  //reserva a entrada antes do cluster para não perder o cluster se o diretório estiver cheio
+  int i = dir_pega_livre();
+  if(i == -1){
+    //sem entradas livres, o diretório ganha mais um cluster; os vetores mudam de lugar
+    trava_todos();
+    pthread_mutex_lock(&trava_fat);
+    int cresceu = dir_cresce();
+    pthread_mutex_unlock(&trava_fat);
+    destrava_todos();
+    if(!cresceu || (i = dir_pega_livre()) == -1){
+      printf("Erro! Diretório cheio\n");
+      return 0;
+    }
+  }
+
+  pthread_mutex_lock(&trava_fat);
+  //procura uma celuala livre no FAT
+  int primeiro_bloco = aloca_cluster();
+  if(primeiro_bloco == -1){
+    pthread_mutex_unlock(&trava_fat);
+    printf("FAT sem espaco\n");
+    dir_devolve(i);
+    return 0;
+  }
+  fat_set(primeiro_bloco, 2); //marca essa celula como incio e fim de um arquivo (o arquivo tem tamanho 0, por isso, o inicio e o fim eh igual)
+
+  dir[i].used = 1;
+  strcpy(dir[i].name,file_name);
+  dir[i].size = 0;
+  dir[i].first_block = primeiro_bloco;
+  dir_indexa(i);
+  dir_marca(i);
+  pthread_mutex_unlock(&trava_fat);
+
+  return 1;
+}
+
+int fs_create(char* file_name) {
+  long long traco = traco_inicio();
+  long long inicio = op_inicio(FS_OP_CREATE);
+  pthread_mutex_lock(&trava_dir);
+  int ok = cria_arquivo(file_name);
+  pthread_mutex_unlock(&trava_dir);
+  if (ok) {
+    sincroniza(FS_SYNC_CLOSE);
+  }
+  op_fim(FS_OP_CREATE, inicio);
+  traco_fim(FS_OP_CREATE, traco, file_name, 0, -1, 0, 0, ok);
+  return ok;
+}
+
+/* libera a entrada e a cadeia do arquivo; quem chama sincroniza, como em cria_arquivo */
+int remove_arquivo(char *file_name) {
+  if(!verifica_formatacao()){
+    return 0;
+  }
+  
+  //procura o arquivo no índice do diretório
+  int i = dir_busca(file_name);
+  if(i == -1){
+    printf("Erro! Arquivo não encontrado!\n");
+    return 0;
+  }
+
+  //não remove um arquivo com descritores abertos
+  if (__atomic_load_n(&dir_abertos[i], __ATOMIC_SEQ_CST) > 0) {
+    printf("Erro! O arquivo está aberto!\n");
+    return 0;
+  }
+  dir_desindexa(i);
+  dir[i].used = 0;
+  memset(dir[i].name, ' ', 25*sizeof(char)); //inicializa o nome da string com " " em todas as celulas.
+  dir[i].size = 0;
+
+  //libera a cadeia de clusters do arquivo até o marcador de fim (2)
+  pthread_mutex_lock(&trava_fat);
+  int bloco_procurar = dir[i].first_block;
+  int temp = -1;
+  while(temp != 2){
+    temp = fat_le(bloco_procurar);
+    fat_set(bloco_procurar, 1);
+    bloco_procurar = temp;
+  }
+  dir[i].first_block = 1;
+  dir_marca(i);
+  pthread_mutex_unlock(&trava_fat);
+  dir_devolve(i);
+
+  return 1;
+}
+
+int fs_remove(char *file_name) {
+  long long traco = traco_inicio();
+  long long inicio = op_inicio(FS_OP_REMOVE);
+  pthread_mutex_lock(&trava_dir);
+  int ok = remove_arquivo(file_name);
+  pthread_mutex_unlock(&trava_dir);
+  if (ok) {
+    sincroniza(FS_SYNC_CLOSE);
+  }
+  op_fim(FS_OP_REMOVE, inicio);
+  traco_fim(FS_OP_REMOVE, traco, file_name, 0, -1, 0, 0, ok);
+  return ok;
+}
+
+/*
+ * Grava em segundo plano n clusters contíguos a partir de inicio. Os dados
+ * são copiados para um dos buffers de escrita do arquivo, assim o fs_write
+ * volta antes da gravação terminar e quem escreve pode preparar o próximo
+ * pedaço (ler o arquivo real, por exemplo) enquanto a imagem é gravada.
+ */
+void escreve_trecho(arquivosAbertos *arquivo, int inicio, int n, char *dados) {
+  while (n > 0) {
+    int parte = n < trecho_clusters ? n : trecho_clusters;
+    int t = arquivo->trechoProx;
+    int tag = -1;
+
+    arquivo->trechoProx = (t + 1) % TRECHOS;
+    if (arquivo->trechoTag[t] != -1) {
+      bl_aio_wait(arquivo->trechoTag[t]);
+      arquivo->trechoTag[t] = -1;
+    }
+    if (arquivo->trecho[t] == NULL) {
+      arquivo->trecho[t] = malloc(trecho_clusters * tam_cluster);
+    }
+    if (arquivo->trecho[t] != NULL) {
+      memcpy(arquivo->trecho[t], dados, parte * tam_cluster);
+      tag = bl_aio_submit(BL_AIO_WRITE, inicio * setores_cluster, parte * setores_cluster,
+                          arquivo->trecho[t]);
+    }
+    if (tag == -1) {
+      grava_clusters(inicio, parte, dados);
+    }
+    arquivo->trechoTag[t] = tag;
+
+    inicio += parte;
+    n -= parte;
+    dados += parte * tam_cluster;
+  }
+}
+
+/* espera as gravações em segundo plano do arquivo */
+void espera_gravacoes(arquivosAbertos *arquivo) {
+  for (int t = 0; t < TRECHOS; t++) {
+    if (arquivo->trechoTag[t] != -1) {
+      bl_aio_wait(arquivo->trechoTag[t]);
+      arquivo->trechoTag[t] = -1;
+    }
+  }
+}
+
+/* espera as gravações em segundo plano do arquivo e libera os buffers */
+void espera_trechos(arquivosAbertos *arquivo) {
+  espera_gravacoes(arquivo);
+  for (int t = 0; t < TRECHOS; t++) {
+    free(arquivo->trecho[t]);
+    arquivo->trecho[t] = NULL;
+  }
+}
+
+int janela_maxima = RAMAX / 2;
+
+long ra_antecipados = 0;
+long ra_acertos = 0;
+long ra_desperdicados = 0;
+
+/* espera a leitura que traz a posição do anel, liberando as que vieram junto */
+void ra_espera(leitura_antecipada *ra, int pos) {
+  int tag = ra->tag[pos];
+  if (tag == -1) {
+    return;
+  }
+  bl_aio_wait(tag);
+  for (int k = 0; k < RAMAX; k++) {
+    if (ra->tag[k] == tag) {
+      ra->tag[k] = -1;
+    }
+  }
+}
+
+/* esvazia a posição do anel, contando como desperdício se ela nunca foi lida */
+void ra_descarta(leitura_antecipada *ra, int pos) {
+  if (ra->logico[pos] != -1) {
+    ra_espera(ra, pos);
+    if (!ra->usado[pos]) {
+      __atomic_add_fetch(&ra_desperdicados, 1, __ATOMIC_RELAXED);
+    }
+    ra->logico[pos] = -1;
+  }
+}
+
+void libera_antecipada(arquivosAbertos *arquivo) {
+  if (arquivo->ra != NULL) {
+    for (int pos = 0; pos < RAMAX; pos++) {
+      ra_descarta(arquivo->ra, pos);
+    }
+    free(arquivo->ra->dados);
+    free(arquivo->ra);
+    arquivo->ra = NULL;
+  }
+}
+
+/* copia o cluster lógico para destino se ele já foi antecipado */
+int pega_antecipado(arquivosAbertos *arquivo, int logico, char *destino) {
+  leitura_antecipada *ra = arquivo->ra;
+  int pos = logico % ra_posicoes;
+
+  if (ra == NULL || ra->logico[pos] != logico) {
+    return 0;
+  }
+  ra_espera(ra, pos);
+  memcpy(destino, ra->dados + pos * tam_cluster, tam_cluster);
+  ra->usado[pos] = 1;
+  __atomic_add_fetch(&ra_acertos, 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/*
+ * Registra a leitura dos clusters lógicos [primeiro, ultimo], o último deles
+ * no cluster fisico da imagem. Se o acesso está sequencial, percorre a FAT à
+ * frente e pede os clusters da próxima janela em segundo plano.
+ */
+void antecipa(arquivosAbertos *arquivo, int primeiro, int ultimo, int fisico) {
+  leitura_antecipada *ra;
+  int total = (int) ((dir[arquivo->dirIndex].size + tam_cluster - 1) / tam_cluster);
+  int maxima = janela_maxima < ra_posicoes / 2 ? janela_maxima : ra_posicoes / 2;
+
+  if (primeiro == arquivo->ultimoLogico + 1) {
+    arquivo->sequencia += ultimo - primeiro + 1;
+  } else {
+    arquivo->sequencia = 0;
+  }
+  arquivo->ultimoLogico = ultimo;
+  //com a imagem mapeada o próprio kernel já antecipa as páginas
+  if (maxima == 0 || arquivo->sequencia < 2 || bl_map(fisico * setores_cluster) != NULL) {
+    return;
+  }
+
+  if ((ra = arquivo->ra) == NULL) {
+    ra = malloc(sizeof(leitura_antecipada));
+    if (ra == NULL || (ra->dados = malloc(ra_posicoes * tam_cluster)) == NULL) {
+      free(ra);
+      return;
+    }
+    for (int pos = 0; pos < RAMAX; pos++) {
+      ra->logico[pos] = -1;
+      ra->tag[pos] = -1;
+    }
+    ra->proximo = -1;
+    ra->janela = RAJANELA_MIN < maxima ? RAJANELA_MIN : maxima;
+    arquivo->ra = ra;
+  }
+  if (ra->proximo <= ultimo) {
+    //a janela ficou para trás: recomeça logo depois do cluster lido
+    ra->proximo = ultimo + 1;
+  }
+  //só busca a próxima janela quando metade da atual já foi consumida
+  if (ra->proximo - ultimo > ra->janela / 2) {
+    return;
+  }
+
+  int limite = ultimo + 1 + ra->janela < total ? ultimo + 1 + ra->janela : total;
+  while (ra->proximo < limite) {
+    //junta clusters contíguos na imagem e no anel numa só leitura
+    int pos = ra->proximo % ra_posicoes;
+    int inicio = arquivo->mapa[ra->proximo];
+    int cont = 0;
+    while (ra->proximo < limite && pos + cont < ra_posicoes && arquivo->mapa[ra->proximo] == inicio + cont) {
+      ra_descarta(ra, pos + cont);
+      ra->logico[pos + cont] = ra->proximo;
+      ra->usado[pos + cont] = 0;
+      ra->proximo++;
+      cont++;
+    }
+    char *destino = ra->dados + pos * tam_cluster;
+    int tag = bl_aio_submit(BL_AIO_READ, inicio * setores_cluster, cont * setores_cluster, destino);
+    if (tag == -1) {
+      le_clusters(inicio, cont, destino);
+    }
+    for (int k = 0; k < cont; k++) {
+      ra->tag[pos + k] = tag;
+    }
+    __atomic_add_fetch(&ra_antecipados, cont, __ATOMIC_RELAXED);
+  }
+  if (ra->janela < maxima) {
+    ra->janela = ra->janela * 2 < maxima ? ra->janela * 2 : maxima;
+  }
+}
+
+/* encadeia um novo cluster no fim do arquivo cujo último bloco acabou de encher */
+int avanca_cluster(arquivosAbertos *arquivo) {
+  pthread_mutex_lock(&trava_fat);
+  int novoBloco = proximo_cluster(arquivo);
+  if (novoBloco == -1) {
+    pthread_mutex_unlock(&trava_fat);
+    return 0;
+  }
+  if (!mapa_acrescenta(arquivo, novoBloco)) {
+    if (modo_alocacao == FS_ALLOC_EXTENT) {
+      arquivo->reservaInicio--;
+    }
+    pthread_mutex_unlock(&trava_fat);
+    return 0;
+  }
+
+  // Atualiza a FAT com o novo bloco alocado, que passa a ser o fim da cadeia
+  fat_set(arquivo->fim, novoBloco);
+  fat_set(novoBloco, 2);
+  arquivo->fim = novoBloco;  // Atualiza o bloco final do arquivo
+  arquivo->posicaoEscrita = 0;  // Reinicializa a posição de escrita para o novo bloco
+  dir[arquivo->dirIndex].size = (long long) (arquivo->mapaTam - 1) * tam_cluster;  // Atualiza o tamanho do arquivo no diretório
+  dir_marca(arquivo->dirIndex);
+  pthread_mutex_unlock(&trava_fat);
+  return 1;
+}
+
+/*
+ * Escreve n clusters inteiros direto do buffer do usuário, com o arquivo no
+ * início de um cluster. Os trechos contíguos na imagem vão numa só
+ * bl_write_range. Devolve quantos bytes foram escritos.
+ */
+int escreve_clusters(arquivosAbertos *arquivo, char *buffer, int n) {
+  int inicio = arquivo->fim;  // primeiro cluster da sequência ainda não gravada
+  int pendentes = 0;
+
+  for (int k = 0; k < n; k++) {
+    pendentes++;
+    arquivo->posicaoEscrita = tam_cluster;
+    if (!avanca_cluster(arquivo)) {
+      // O último bloco fica também na memória para o fs_close regravá-lo
+      escreve_trecho(arquivo, inicio, pendentes, buffer + (k + 1 - pendentes) * tam_cluster);
+      memcpy(arquivo->memoria, buffer + k * tam_cluster, tam_cluster);
+      printf("Erro! Disco cheio\n");
+      return (k + 1) * tam_cluster;
+    }
+    if (arquivo->fim != inicio + pendentes) {
+      // A cadeia deixou de ser contígua: grava o que já se acumulou
+      escreve_trecho(arquivo, inicio, pendentes, buffer + (k + 1 - pendentes) * tam_cluster);
+      inicio = arquivo->fim;
+      pendentes = 0;
+    }
+  }
+  if (pendentes > 0) {
+    escreve_trecho(arquivo, inicio, pendentes, buffer + (n - pendentes) * tam_cluster);
+  }
+  return n * tam_cluster;
+}
+
+/* acrescenta size bytes no fim do arquivo, devolve quantos couberam */
+int escreve_fim(arquivosAbertos *arquivo, char *buffer, int size) {
+  // Copia o buffer em trechos de até um cluster
+  int escritos = 0;
+  while (escritos < size) {
+    // Bloco cheio sem sucessor (o disco encheu antes ou o arquivo foi aberto assim)
+    if (arquivo->posicaoEscrita == tam_cluster && !avanca_cluster(arquivo)) {
+      printf("Erro! Disco cheio\n");
+      break;
+    }
+
+    int resta = size - escritos;
+    if (arquivo->posicaoEscrita == 0 && resta >= tam_cluster) {
+      // Clusters inteiros alinhados: vão direto do buffer do usuário para o disco
+      escritos += escreve_clusters(arquivo, buffer + escritos, resta / tam_cluster);
+      continue;
+    }
+
+    // Completa o bloco em memória com o que couber dele
+    int n = tam_cluster - arquivo->posicaoEscrita;
+    if (n > resta) {
+      n = resta;
+    }
+    memcpy(arquivo->memoria + arquivo->posicaoEscrita, buffer + escritos, n);
+    arquivo->posicaoEscrita += n;
+    escritos += n;
+
+    // Verifica se atingiu o limite do bloco (tamanho do cluster)
+    if (arquivo->posicaoEscrita == tam_cluster) {
+      grava_cluster(arquivo->fim, arquivo->memoria);
+      if (!avanca_cluster(arquivo)) {
+        // O bloco cheio fica na memória e é gravado de novo pelo fs_close
+        printf("Erro! Disco cheio\n");
+        break;
+      }
+    }
+  }
+
+  // Marca o bloco final como o último bloco usado (valor 2 na FAT)
+  pthread_mutex_lock(&trava_fat);
+  fat_set(arquivo->fim, 2);
+  pthread_mutex_unlock(&trava_fat);
+  __atomic_add_fetch(&bytes_usuario_gravados, escritos, __ATOMIC_RELAXED);
+
+  return escritos;  // Retorna o número de bytes que foram escritos
+}
+
+int tamanho_acumulo = ACUMULO_PADRAO;
+
+/*
+ * Grava o buffer de escrita do arquivo. Só agora os clusters são escolhidos:
+ * sabendo quantos faltam, a reserva é refeita com pelo menos esse tamanho
+ * para que todos fiquem contíguos e saiam em poucas escritas grandes.
+ */
+int descarrega(arquivosAbertos *arquivo) {
+  int n = arquivo->pendenteTam;
+
+  arquivo->pendenteMax = 0;
+  if (n == 0) {
+    return 0;
+  }
+  if (modo_alocacao == FS_ALLOC_EXTENT) {
+    int precisa = (arquivo->posicaoEscrita + n) / tam_cluster;
+    if (arquivo->reservaFim - arquivo->reservaInicio < precisa) {
+      pthread_mutex_lock(&trava_fat);
+      libera_reserva(arquivo->reservaInicio, arquivo->reservaFim);
+      pthread_mutex_unlock(&trava_fat);
+      arquivo->reservaInicio = arquivo->reservaFim = 0;
+      if (arquivo->reservaTam < precisa) {
+        arquivo->reservaTam = precisa;
+      }
+    }
+  }
+  arquivo->pendenteTam = 0;
+  return escreve_fim(arquivo, arquivo->pendente, n);
+}
+
+long long espaco_livre(arquivosAbertos *arquivo) {
+  pthread_mutex_lock(&trava_fat);
+  int livres = livres_total;
+  pthread_mutex_unlock(&trava_fat);
+  return tam_cluster - arquivo->posicaoEscrita
+    + (long long) (livres + arquivo->reservaFim - arquivo->reservaInicio) * tam_cluster;
+}
+
+/*
+ * Acrescenta ao buffer de escrita do arquivo, descarregando-o quando enche.
+ * Se o disco não comportar o que está acumulado a escrita vai direto, assim
+ * quem escreve ainda recebe a contagem exata quando o disco enche.
+ */
+int acumula(arquivosAbertos *arquivo, char *buffer, int size) {
+  if (arquivo->pendenteTam + size > arquivo->pendenteMax) {
+    descarrega(arquivo);
+    //o limite vale até o próximo descarregamento
+    long long livre = espaco_livre(arquivo);
+    arquivo->pendenteMax = tamanho_acumulo < livre ? tamanho_acumulo : (int) livre;
+  }
+  if (size >= arquivo->pendenteMax) {
+    return escreve_fim(arquivo, buffer, size);
+  }
+  if (arquivo->pendente == NULL && (arquivo->pendente = malloc(tamanho_acumulo)) == NULL) {
+    arquivo->pendenteMax = 0;
+    return escreve_fim(arquivo, buffer, size);
+  }
+  memcpy(arquivo->pendente + arquivo->pendenteTam, buffer, size);
+  arquivo->pendenteTam += size;
+  return size;
+}
+
+// -------- PARTE 2 ------------------
+/* monta a estrutura do arquivo aberto na entrada, com a trava do seu grupo */
+int instala_arquivo(int file, int arquivo_encontrado, int mode) {
+  // Cada descritor tem seu próprio bloco em memória, tirado do conjunto de buffers
+  arquivosAbertos *arquivo = &descritores[file];
+  arquivo->memoria = buffer_pega();
+  if (arquivo->memoria == NULL) {
+    printf("Erro! Sem memória para abrir o arquivo\n");
+    return -1;
+  }
+
+  // Configura as informações iniciais para o arquivo aberto
+  arquivo->primeiro = dir[arquivo_encontrado].first_block;  // Armazena o primeiro bloco do arquivo
+  arquivo->fim = arquivo->primeiro;  // Inicializa o bloco final como o primeiro bloco
+  arquivo->categoria = mode;  // Define o modo de abertura (leitura ou escrita)
+  arquivo->ocupado = 1;  // Marca o arquivo como "ocupado" (aberto)
+  arquivo->dirIndex = arquivo_encontrado;  // Armazena o índice do arquivo no diretório
+  arquivo->posicaoEscrita = 0;  // Inicializa a posição de escrita no arquivo
+  arquivo->posicaoLeitura = 0;  // Inicializa a posição de leitura no arquivo
+  arquivo->totalLido = 0;  // Inicializa o total de bytes lidos como zero
+  arquivo->carregado = 0;  // O primeiro bloco só é lido na primeira leitura parcial
+  arquivo->ultimoLogico = -1;
+  arquivo->sequencia = 0;
+  arquivo->ra = NULL;
+  arquivo->trechoProx = 0;
+  for (int t = 0; t < TRECHOS; t++) {
+    arquivo->trecho[t] = NULL;
+    arquivo->trechoTag[t] = -1;
+  }
+  arquivo->reservaInicio = arquivo->reservaFim = 0;
+  arquivo->reservaTam = prealoca_min;
+  arquivo->reservaExata = 0;
+  arquivo->posicao = 0;
+  arquivo->pendente = NULL;
+  arquivo->pendenteTam = arquivo->pendenteMax = 0;
+
+  // Mapa dos clusters do arquivo para fs_seek, fs_pread e fs_pwrite
+  if (!monta_mapa(arquivo)) {
+    printf("Erro! Sem memória para abrir o arquivo\n");
+    free(arquivo->mapa);
+    buffer_devolve(arquivo->memoria);
+    arquivo->ocupado = 0;
+    return -1;
+  }
+
+  // Sem truncar, a escrita continua do último cluster, que vai para a memória
+  if (mode == FS_A || mode == FS_RW) {
+    arquivo->fim = arquivo->mapa[arquivo->mapaTam - 1];
+    arquivo->posicaoEscrita = (int) (dir[arquivo_encontrado].size - (long long) (arquivo->mapaTam - 1) * tam_cluster);
+    if (arquivo->posicaoEscrita > 0) {
+      le_cluster(arquivo->fim, arquivo->memoria);
+    }
+    arquivo->posicao = mode == FS_A ? dir[arquivo_encontrado].size : 0;
+  }
+
+  return file;  // Retorna o descritor
+}
+
+/* abre o arquivo; *truncou diz se FS_W o recriou e os metadados precisam ser sincronizados */
+int abre_arquivo(char *file_name, int mode, int *truncou) {
+  // Busca o arquivo no diretório
+  int arquivo_encontrado = -1;  // Variável para armazenar o índice do arquivo no diretório
+
+  // Procura o arquivo pelo nome no índice do diretório
+  arquivo_encontrado = dir_busca(file_name);
+
+  // Verifica se o arquivo foi encontrado no diretório
+  if (arquivo_encontrado == -1) {
+    printf("Erro! O arquivo não foi encontrado!\n");  // Mostra mensagem de erro se o arquivo não foi encontrado
+    return -1;  // Retorna -1 indicando falha
+  }
+
+  // A entrada aceita vários leitores ou um único descritor de escrita
+  if (__atomic_load_n(&dir_escrita[arquivo_encontrado], __ATOMIC_SEQ_CST)
+      || (mode != FS_R && __atomic_load_n(&dir_abertos[arquivo_encontrado], __ATOMIC_SEQ_CST) > 0)) {
+    printf("Erro! O arquivo já está aberto!\n");
+    return -1;
+  }
+
+  // Se o modo de abertura for para escrita (FS_W)
+  if (mode == FS_W) {
+    // Remove o arquivo existente e recria um novo com o mesmo nome
+    remove_arquivo(file_name);  // Remove o arquivo antigo
+    cria_arquivo(file_name);  // Cria um novo arquivo com tamanho zero
+    *truncou = 1;
+
+    // Procura novamente o arquivo recém-criado no diretório
+    arquivo_encontrado = dir_busca(file_name);
+    if (arquivo_encontrado == -1) {
+      return -1;
+    }
+  }
+
+  // Tira um descritor livre da tabela
+  int file = descritor_pega();
+  if (file == -1) {
+    printf("Erro! Muitos arquivos abertos!\n");
+    return -1;
+  }
+
+  // A estrutura do descritor é montada com a trava do seu grupo
+  trava_arquivo(file);
+  int ok = instala_arquivo(file, arquivo_encontrado, mode);
+  destrava_arquivo(file);
+  if (ok == -1) {
+    descritor_devolve(file);
+    return -1;
+  }
+
+  // Conta mais um descritor apontando para a entrada
+  __atomic_add_fetch(&dir_abertos[arquivo_encontrado], 1, __ATOMIC_SEQ_CST);
+  dir_escrita[arquivo_encontrado] = mode != FS_R;
+  return file;
+}
+
+int fs_open(char *file_name, int mode) {
+  long long traco = traco_inicio();
+  long long inicio = op_inicio(FS_OP_OPEN);
+  int truncou = 0;
+  pthread_mutex_lock(&trava_dir);
+  int file = abre_arquivo(file_name, mode, &truncou);
+  pthread_mutex_unlock(&trava_dir);
+  if (truncou) {
+    sincroniza(FS_SYNC_CLOSE);
+  }
+  op_fim(FS_OP_OPEN, inicio);
+  traco_fim(FS_OP_OPEN, traco, file_name, mode, -1, 0, 0, file);
+  return file;
+}
+
+
+/*
+ * Primeira parte do fechamento de um arquivo aberto para escrita, só com a
+ * trava do arquivo: leva à imagem o que estava acumulado e o bloco final.
+ * Devolve 1 se o descritor é de escrita e ainda falta atualizar o diretório.
+ */
+int grava_restante(int file) {
+  arquivosAbertos *arquivo = pega_arquivo(file);
+
+  if (arquivo == NULL || !arquivo->ocupado || arquivo->categoria == FS_R) {
+    return 0;
+  }
+  // Aloca e grava o que ainda estava acumulado
+  descarrega(arquivo);
+  free(arquivo->pendente);
+  arquivo->pendente = NULL;
+
+  // Espera as gravações em segundo plano antes de atualizar os metadados
+  espera_trechos(arquivo);
+
+  // Grava qualquer conteúdo restante no buffer para o bloco final do arquivo
+  grava_cluster(arquivo->fim, arquivo->memoria);
+  return 1;
+}
+
+/* fecha o descritor; nos modos de escrita exige trava_dir, além da do arquivo */
+int fecha_arquivo(int file) {
+  // Obtém a estrutura do arquivo correspondente ao descritor fornecido
+  arquivosAbertos *arquivo = pega_arquivo(file);
+
+  // Verifica se o arquivo realmente está aberto (ocupado)
+  if (arquivo == NULL || !arquivo->ocupado) {
+    // Se o arquivo não estiver aberto, exibe uma mensagem de erro e retorna -1
+    printf("Erro: arquivo com file %d não está aberto.\n", file);
+    return -1;
+  }
+
+  // Verifica se o arquivo foi aberto para escrita (FS_W, FS_A ou FS_RW)
+  if (arquivo->categoria != FS_R) {
+    // Atualiza o tamanho no diretório e devolve a parte da pré-alocação que não foi usada
+    pthread_mutex_lock(&trava_fat);
+    dir[arquivo->dirIndex].size = tamanho_atual(arquivo);
+    dir_marca(arquivo->dirIndex);
+    libera_reserva(arquivo->reservaInicio, arquivo->reservaFim);
+    pthread_mutex_unlock(&trava_fat);
+    arquivo->reservaInicio = arquivo->reservaFim = 0;
+  }
+
+  // Devolve os buffers, a entrada do diretório e o descritor
+  libera_antecipada(arquivo);
+  free(arquivo->mapa);
+  buffer_devolve(arquivo->memoria);
+  arquivo->ocupado = 0;
+  if (arquivo->categoria != FS_R) {
+    __atomic_store_n(&dir_escrita[arquivo->dirIndex], 0, __ATOMIC_SEQ_CST);
+  }
+  __atomic_sub_fetch(&dir_abertos[arquivo->dirIndex], 1, __ATOMIC_SEQ_CST);
+  descritor_devolve(file);
+
+  // Retorna 0 indicando que o fechamento foi bem-sucedido
+  return 0;
+}
+
+int fs_close(int file) {
+  long long traco = traco_inicio();
+  long long inicio = op_inicio(FS_OP_CLOSE);
+  //os dados vão para a imagem só com a trava do arquivo; o diretório muda
+  //depois, com trava_dir tomada antes da trava do arquivo, como manda a ordem
+  trava_arquivo(file);
+  int escrita = grava_restante(file);
+  destrava_arquivo(file);
+  if (escrita) {
+    pthread_mutex_lock(&trava_dir);
+  }
+  trava_arquivo(file);
+  int ok = fecha_arquivo(file);
+  destrava_arquivo(file);
+  if (escrita) {
+    pthread_mutex_unlock(&trava_dir);
+    // Salva os metadados alterados pelo arquivo no disco
+    sincroniza(FS_SYNC_CLOSE);
+  }
+  op_fim(FS_OP_CLOSE, inicio);
+  traco_fim(FS_OP_CLOSE, traco, NULL, 0, file, 0, 0, ok);
+  return ok;
+}
+
+
+/*
+ * Lê até size bytes a partir de offset usando o mapa de clusters, sem mexer
+ * na posição de fs_read. Nos modos de escrita o último cluster vem do bloco
+ * em memória.
+ */
+int le_posicional(arquivosAbertos *arquivo, char *buffer, int size, long long offset) {
+  //o que está pendente muda o mapa e o bloco em memória: vai para eles antes
+  if (arquivo->categoria != FS_R) {
+    descarrega(arquivo);
+    espera_gravacoes(arquivo);
+  }
+  long long tamanho = tamanho_atual(arquivo);
+  int ultimo = arquivo->categoria == FS_R ? arquivo->mapaTam : arquivo->mapaTam - 1;
+  int lidos = 0;
+
+  if (offset >= tamanho) {
+    return 0;
+  }
+  if (size > tamanho - offset) {
+    size = tamanho - offset;
+  }
+  while (lidos < size) {
+    int logico = (int) ((offset + lidos) / tam_cluster);
+    int desloc = (int) ((offset + lidos) % tam_cluster);
+    int n = tam_cluster - desloc < size - lidos ? tam_cluster - desloc : size - lidos;
+
+    if (logico >= ultimo) {
+      memcpy(buffer + lidos, arquivo->memoria + desloc, n);
+    } else if (n == tam_cluster) {
+      // Clusters inteiros contíguos na imagem numa só leitura
+      int cont = 1;
+      while (lidos + (cont + 1) * tam_cluster <= size && logico + cont < ultimo
+             && arquivo->mapa[logico + cont] == arquivo->mapa[logico] + cont) {
+        cont++;
+      }
+      le_clusters(arquivo->mapa[logico], cont, buffer + lidos);
+      n = cont * tam_cluster;
+    } else {
+      // Pedaço de um cluster, lido num buffer emprestado do conjunto
+      char *bloco = buffer_pega();
+      if (bloco == NULL) {
+        break;
+      }
+      le_cluster(arquivo->mapa[logico], bloco);
+      memcpy(buffer + lidos, bloco + desloc, n);
+      buffer_devolve(bloco);
+    }
+    lidos += n;
+  }
+  return lidos;
+}
+
+/* altera no lugar size bytes a partir de offset, todos dentro do tamanho atual */
+int escreve_posicional(arquivosAbertos *arquivo, char *buffer, int size, long long offset) {
+  int escritos = 0;
+
+  // A gravação no lugar não pode ser ultrapassada por uma cópia antiga em voo
+  espera_gravacoes(arquivo);
+  while (escritos < size) {
+    int logico = (int) ((offset + escritos) / tam_cluster);
+    int desloc = (int) ((offset + escritos) % tam_cluster);
+    int n = tam_cluster - desloc < size - escritos ? tam_cluster - desloc : size - escritos;
+
+    if (logico == arquivo->mapaTam - 1) {
+      // O último cluster fica na memória e é gravado pelo fs_close
+      memcpy(arquivo->memoria + desloc, buffer + escritos, n);
+    } else if (n == tam_cluster) {
+      int cont = 1;
+      while (escritos + (cont + 1) * tam_cluster <= size && logico + cont < arquivo->mapaTam - 1
+             && arquivo->mapa[logico + cont] == arquivo->mapa[logico] + cont) {
+        cont++;
+      }
+      grava_clusters(arquivo->mapa[logico], cont, buffer + escritos);
+      n = cont * tam_cluster;
+    } else {
+      char *bloco = buffer_pega();
+      if (bloco == NULL) {
+        break;
+      }
+      le_cluster(arquivo->mapa[logico], bloco);
+      memcpy(bloco + desloc, buffer + escritos, n);
+      grava_cluster(arquivo->mapa[logico], bloco);
+      buffer_devolve(bloco);
+    }
+    escritos += n;
+  }
+  __atomic_add_fetch(&bytes_usuario_gravados, escritos, __ATOMIC_RELAXED);
+  return escritos;
+}
+
+char zeros[CLUSTERSIZE_MAX];
+
+/* escreve em offset: altera no lugar o que já existe e acrescenta o resto no fim */
+int escreve_em(arquivosAbertos *arquivo, char *buffer, int size, long long offset) {
+  int escritos = 0;
+
+  descarrega(arquivo);
+  long long tamanho = tamanho_atual(arquivo);
+
+  if (offset < tamanho) {
+    int dentro = size < tamanho - offset ? size : tamanho - offset;
+    escritos = escreve_posicional(arquivo, buffer, dentro, offset);
+    if (escritos < dentro) {
+      return escritos;
+    }
+  }
+  //um offset além do fim deixa um buraco, que é preenchido com zeros
+  while (tamanho < offset) {
+    int n = offset - tamanho < tam_cluster ? (int) (offset - tamanho) : tam_cluster;
+    if (escreve_fim(arquivo, zeros, n) != n) {
+      return 0;
+    }
+    tamanho += n;
+  }
+  if (escritos < size) {
+    escritos += escreve_fim(arquivo, buffer + escritos, size - escritos);
+  }
+  return escritos;
+}
+
+int escreve_arquivo(char *buffer, int size, int file) {
+  // Obtém a estrutura do arquivo que está sendo escrito
+  arquivosAbertos *arquivo = pega_arquivo(file);
+
+  // Verifica se o arquivo está aberto para escrita e se está em uso
+  if (arquivo == NULL || arquivo->categoria == FS_R || !arquivo->ocupado) {
+    return -1;  // Retorna -1 se o arquivo não estiver no modo de escrita ou não estiver aberto
+  }
+
+  long long tamanho = tamanho_atual(arquivo);
+  if (arquivo->categoria == FS_A) {
+    arquivo->posicao = tamanho;
+  }
+
+  int escritos;
+  if (arquivo->posicao == tamanho && arquivo->pendenteTam == 0
+      && size < tam_cluster - arquivo->posicaoEscrita) {
+    // Caminho rápido: a escrita cabe no bloco em memória sem completá-lo
+    memcpy(arquivo->memoria + arquivo->posicaoEscrita, buffer, size);
+    arquivo->posicaoEscrita += size;
+    __atomic_add_fetch(&bytes_usuario_gravados, size, __ATOMIC_RELAXED);
+    escritos = size;
+  } else if (arquivo->posicao == tamanho && arquivo->pendenteTam > 0
+             && arquivo->pendenteTam + size < arquivo->pendenteMax) {
+    // Idem para o buffer de escrita que já está acumulando
+    memcpy(arquivo->pendente + arquivo->pendenteTam, buffer, size);
+    arquivo->pendenteTam += size;
+    escritos = size;
+  } else if (arquivo->posicao == tamanho) {
+    escritos = acumula(arquivo, buffer, size);
+  } else {
+    escritos = escreve_em(arquivo, buffer, size, arquivo->posicao);
+  }
+  arquivo->posicao += escritos;
+
+  // Só grava os metadados agora se a política pedir sincronização a cada escrita
+  if (politica_sync == FS_SYNC_WRITE) {
+    descarrega(arquivo);
+  }
+  sincroniza(FS_SYNC_WRITE);
+
+  return escritos;  // Retorna o número de bytes que foram escritos
+}
+
+int fs_write(char *buffer, int size, int file) {
+  long long traco = traco_inicio();
+  long long inicio = op_inicio(FS_OP_WRITE);
+  trava_arquivo(file);
+  int escritos = escreve_arquivo(buffer, size, file);
+  destrava_arquivo(file);
+  op_fim(FS_OP_WRITE, inicio);
+  traco_fim(FS_OP_WRITE, traco, NULL, 0, file, size, 0, escritos);
+  return escritos;
+}
+
+int le_arquivo(char *buffer, int size, int file) {
+  // Obtém a estrutura de arquivos abertos para o arquivo fornecido
+  arquivosAbertos *arquivo = pega_arquivo(file);
+
+  // Verifica se o arquivo está aberto no modo de leitura e se está realmente em uso
+  if (arquivo == NULL || (arquivo->categoria != FS_R && arquivo->categoria != FS_RW) || !arquivo->ocupado) {
+    printf("Erro! ");  // Mostra uma mensagem de erro se o arquivo não está em modo leitura ou não está aberto
+    return -1;          // Retorna -1 indicando erro
+  }
+
+  // Lendo e alterando o mesmo arquivo, a leitura segue a posição comum com fs_write
+  if (arquivo->categoria == FS_RW) {
+    int n = le_posicional(arquivo, buffer, size, arquivo->posicao);
+    arquivo->posicao += n;
+    return n;
+  }
+
+  int lidos = 0;          // Variável que conta quantos bytes foram lidos
+  long long tamanho = dir[arquivo->dirIndex].size;
+
+  // Caminho rápido: a leitura está toda dentro do bloco já carregado
+  if (arquivo->carregado && size < tam_cluster - arquivo->posicaoLeitura
+      && size <= tamanho - arquivo->totalLido) {
+    memcpy(buffer, arquivo->memoria + arquivo->posicaoLeitura, size);
+    arquivo->posicaoLeitura += size;
+    arquivo->totalLido += size;
+    return size;
+  }
+
+  // Copia trechos de até um cluster até "size" bytes ou até o fim do arquivo
+  while (lidos < size && arquivo->totalLido < tamanho) {
+    // Terminou o bloco atual: segue a FAT (o próximo só é lido quando preciso)
+    if (arquivo->posicaoLeitura == tam_cluster) {
+      arquivo->fim = arquivo->mapa[arquivo->totalLido / tam_cluster];
+      arquivo->posicaoLeitura = 0;
+      arquivo->carregado = 0;
+    }
+
+    int n = tam_cluster - arquivo->posicaoLeitura;
+    if (n > size - lidos) {
+      n = size - lidos;
+    }
+    if (n > tamanho - arquivo->totalLido) {
+      n = tamanho - arquivo->totalLido;
+    }
+
+    char *mapeado;
+    if (n == tam_cluster) {
+      // Clusters inteiros alinhados: lê direto para o buffer do usuário. Cada
+      // trecho contíguo da cadeia é uma leitura assíncrona e todas ficam em voo juntas
+      int maximo = (size - lidos < tamanho - arquivo->totalLido ? size - lidos : (int) (tamanho - arquivo->totalLido)) / tam_cluster;
+      int feitos = 0;
+      int tags[LEITURASVOO];
+      int ntags = 0;
+      int primeiro = (int) (arquivo->totalLido / tam_cluster);
+      while (feitos < maximo) {
+        if (feitos > 0) {
+          arquivo->fim = arquivo->mapa[primeiro + feitos];
+        }
+        char *destino = buffer + lidos + feitos * tam_cluster;
+        if (pega_antecipado(arquivo, primeiro + feitos, destino)) {
+          feitos++;
+          continue;
+        }
+        int inicio = arquivo->fim;
+        int cont = 1;
+        while (feitos + cont < maximo && arquivo->mapa[primeiro + feitos + cont] == arquivo->fim + 1) {
+          arquivo->fim++;
+          cont++;
+        }
+        int tag = ntags < LEITURASVOO
+                  ? bl_aio_submit(BL_AIO_READ, inicio * setores_cluster, cont * setores_cluster, destino) : -1;
+        if (tag == -1) {
+          le_clusters(inicio, cont, destino);
+        } else {
+          tags[ntags++] = tag;
+        }
+        feitos += cont;
+      }
+      for (int t = 0; t < ntags; t++) {
+        bl_aio_wait(tags[t]);
+      }
+      antecipa(arquivo, primeiro, primeiro + feitos - 1, arquivo->fim);
+      arquivo->posicaoLeitura = tam_cluster;  // fim agora é o último cluster lido
+      arquivo->totalLido += feitos * tam_cluster;
+      lidos += feitos * tam_cluster;
+      continue;
+    } else if ((mapeado = bl_map(arquivo->fim * setores_cluster)) != NULL) {
+      // Imagem mapeada: copia o trecho direto do mapeamento, sem passar por memoria
+      memcpy(buffer + lidos, mapeado + arquivo->posicaoLeitura, n);
+    } else {
+      if (!arquivo->carregado) {
+        int logico = (int) (arquivo->totalLido / tam_cluster);
+        if (!pega_antecipado(arquivo, logico, arquivo->memoria)) {
+          le_cluster(arquivo->fim, arquivo->memoria);
+        }
+        arquivo->carregado = 1;
+        antecipa(arquivo, logico, logico, arquivo->fim);
+      }
+      memcpy(buffer + lidos, arquivo->memoria + arquivo->posicaoLeitura, n);
+    }
+    arquivo->posicaoLeitura += n;
+    arquivo->totalLido += n;
+    lidos += n;
+  }
+
+  return lidos;  // Retorna o número total de bytes lidos com sucesso
+}
+
+int fs_read(char *buffer, int size, int file) {
+  long long traco = traco_inicio();
+  long long inicio = op_inicio(FS_OP_READ);
+  trava_arquivo(file);
+  int lidos = le_arquivo(buffer, size, file);
+  destrava_arquivo(file);
+  op_fim(FS_OP_READ, inicio);
+  traco_fim(FS_OP_READ, traco, NULL, 0, file, size, 0, lidos);
+  return lidos;
+}
+
+/* coloca o cursor de leitura sequencial de um arquivo FS_R no deslocamento offset */
+void posiciona_leitura(arquivosAbertos *arquivo, long long offset) {
+  int logico = (int) (offset / tam_cluster);
+
+  if (offset > 0 && offset % tam_cluster == 0) {
+    // No limite de um cluster o cursor fica no fim do anterior, como depois de lê-lo
+    arquivo->fim = arquivo->mapa[logico - 1];
+    arquivo->posicaoLeitura = tam_cluster;
+  } else {
+    arquivo->fim = arquivo->mapa[logico];
+    arquivo->posicaoLeitura = offset % tam_cluster;
+  }
+  arquivo->totalLido = offset;
+  arquivo->carregado = 0;
+}
+
+long long reposiciona(long long offset, int whence, int file) {
+  arquivosAbertos *arquivo = pega_arquivo(file);
+  long long base;
+
+  if (arquivo == NULL || !arquivo->ocupado) {
+    return -1;
+  }
+  if (whence == FS_SEEK_SET) {
+    base = 0;
+  } else if (whence == FS_SEEK_CUR) {
+    base = arquivo->categoria == FS_R ? arquivo->totalLido : arquivo->posicao;
+  } else if (whence == FS_SEEK_END) {
+    base = tamanho_atual(arquivo);
+  } else {
+    return -1;
+  }
+  long long novo = base + offset;
+  if (novo < 0) {
+    return -1;
+  }
+
+  if (arquivo->categoria == FS_R) {
+    // Só para leitura não dá para passar do fim
+    if (novo > dir[arquivo->dirIndex].size) {
+      return -1;
+    }
+    posiciona_leitura(arquivo, novo);
+  } else {
+    // Nos modos de escrita o buraco deixado além do fim é preenchido na próxima escrita
+    arquivo->posicao = novo;
+  }
+  return novo;
+}
+
+long long fs_seek(long long offset, int whence, int file) {
+  long long inicio = traco_inicio();
+  trava_arquivo(file);
+  long long novo = reposiciona(offset, whence, file);
+  destrava_arquivo(file);
+  traco_fim(TR_SEEK, inicio, NULL, whence, file, 0, offset, novo);
+  return novo;
+}
+
+int fs_pread(char *buffer, int size, long long offset, int file) {
+  long long inicio = traco_inicio();
+  int lidos = -1;
+
+  trava_arquivo(file);
+  arquivosAbertos *arquivo = pega_arquivo(file);
+  if (arquivo != NULL && (arquivo->categoria == FS_R || arquivo->categoria == FS_RW)
+      && arquivo->ocupado && offset >= 0) {
+    lidos = le_posicional(arquivo, buffer, size, offset);
+  }
+  destrava_arquivo(file);
+  traco_fim(TR_PREAD, inicio, NULL, 0, file, size, offset, lidos);
+  return lidos;
+}
+
+int fs_pwrite(char *buffer, int size, long long offset, int file) {
+  long long inicio = traco_inicio();
+  int escritos = -1;
+
+  trava_arquivo(file);
+  arquivosAbertos *arquivo = pega_arquivo(file);
+  if (arquivo != NULL && arquivo->categoria != FS_R && arquivo->ocupado && offset >= 0) {
+    escritos = escreve_em(arquivo, buffer, size, offset);
+    sincroniza(FS_SYNC_WRITE);
+  }
+  destrava_arquivo(file);
+  traco_fim(TR_PWRITE, inicio, NULL, 0, file, size, offset, escritos);
+  return escritos;
+}
+
+/* bytes copiados por vez entre o host e a imagem em fs_import/fs_export */
+#define COPIA_TRECHO (64 * 1024 * 1024)
+#define COPIA_BUFFER (1024 * 1024)  // idem, para o que passa pelo processo
+#define IMPORTA_THREADS_MAX 64       // threads de fs_import_files
+
+/* lê até n bytes do descritor do host, só parando antes no fim dele; -1 em erro */
+int le_host(int origem, char *buffer, int n) {
+  int lidos = 0;
+
+  while (lidos < n) {
+    ssize_t c = read(origem, buffer + lidos, n - lidos);
+    if (c < 0) {
+      perror("Erro lendo do host");
+      return -1;
+    }
+    if (c == 0) {
+      break;
+    }
+    lidos += c;
+  }
+  return lidos;
+}
+
+int escreve_host(int destino, char *buffer, int n) {
+  for (int escritos = 0; escritos < n; ) {
+    ssize_t c = write(destino, buffer + escritos, n - escritos);
+    if (c <= 0) {
+      perror("Erro escrevendo no host");
+      return 0;
+    }
+    escritos += c;
+  }
+  return 1;
+}
+
+/*
+ * Aloca n clusters no fim do arquivo, que está no início de um cluster, e
+ * copia cada trecho contíguo deles da origem direto para a imagem, como
+ * escreve_clusters faz com o buffer do usuário. Devolve quantos bytes
+ * foram copiados, -1 em erro.
+ */
+long long importa_clusters(arquivosAbertos *arquivo, int origem, int n) {
+  int inicio = arquivo->fim;  // primeiro cluster da sequência ainda não copiada
+  int pendentes = 0;
+  long long copiados = 0;
+
+  for (int k = 0; k < n; k++) {
+    pendentes++;
+    arquivo->posicaoEscrita = tam_cluster;
+    int cheio = !avanca_cluster(arquivo);
+    if (!cheio && arquivo->fim == inicio + pendentes && k < n - 1) {
+      continue;
+    }
+    // O último bloco de um disco cheio vai para a memória, de onde o fs_close o grava
+    int diretos = cheio ? pendentes - 1 : pendentes;
+    if (diretos > 0) {
+      long c = bl_import(origem, inicio * setores_cluster, diretos * setores_cluster);
+      if (c != (long) diretos * tam_cluster) {
+        if (c >= 0) {
+          printf("Erro! A origem encolheu durante a cópia\n");
+        }
+        return -1;
+      }
+      copiados += c;
+    }
+    if (cheio) {
+      int lidos = le_host(origem, arquivo->memoria, tam_cluster);
+      if (lidos < 0) {
+        return -1;
+      }
+      arquivo->posicaoEscrita = lidos;
+      printf("Erro! Disco cheio\n");
+      return copiados + lidos;
+    }
+    inicio = arquivo->fim;
+    pendentes = 0;
+  }
+  return copiados;
+}
+
+/*
+ * Acrescenta ao fim do arquivo o que resta na origem. Os clusters inteiros
+ * de um arquivo regular vão da origem para a imagem por bl_import; o
+ * pedaço até alinhar com um cluster, o resto que não completa um e origens
+ * de tamanho desconhecido (pipes) passam pelo caminho normal de escrita.
+ */
+long long importa(arquivosAbertos *arquivo, int origem) {
+  char *bloco = buffer_pega();
+  long long total = 0;
+  struct stat st;
+  int regular = fstat(origem, &st) == 0 && S_ISREG(st.st_mode);
+
+  if (bloco == NULL) {
+    return -1;
+  }
+  descarrega(arquivo);
+  if (regular && modo_alocacao == FS_ALLOC_EXTENT) {
+    //o tamanho da origem diz quantos clusters faltam: uma reserva só cobre todos
+    off_t atual = lseek(origem, 0, SEEK_CUR);
+    long long precisa = atual < 0 ? 0 : (st.st_size - atual + arquivo->posicaoEscrita) / tam_cluster;
+    if (precisa > clusters_imagem) {
+      precisa = clusters_imagem;
+    }
+    //reserva do tamanho exato: nada sobra para devolver ao fechar e o mapa
+    //de livres não fica cheio de buracos quando vários arquivos são copiados
+    if (precisa > 0 && arquivo->reservaFim - arquivo->reservaInicio != precisa) {
+      pthread_mutex_lock(&trava_fat);
+      libera_reserva(arquivo->reservaInicio, arquivo->reservaFim);
+      pthread_mutex_unlock(&trava_fat);
+      arquivo->reservaInicio = arquivo->reservaFim = 0;
+      arquivo->reservaTam = (int) precisa;
+      arquivo->reservaExata = 1;
+    }
+  }
+  for (;;) {
+    long long resta = 0;
+    if (regular && arquivo->posicaoEscrita == 0) {
+      off_t atual = lseek(origem, 0, SEEK_CUR);
+      resta = atual < 0 ? 0 : st.st_size - atual;
+    }
+    if (resta >= tam_cluster) {
+      int n = resta < COPIA_TRECHO ? (int) (resta / tam_cluster) : COPIA_TRECHO / tam_cluster;
+      long long copiados = importa_clusters(arquivo, origem, n);
+      if (copiados < 0) {
+        total = -1;
+        break;
+      }
+      total += copiados;
+      __atomic_add_fetch(&bytes_usuario_gravados, copiados, __ATOMIC_RELAXED);
+      if (copiados < (long long) n * tam_cluster) {
+        break;
+      }
+      continue;
+    }
+
+    int n = arquivo->posicaoEscrita < tam_cluster ? tam_cluster - arquivo->posicaoEscrita : tam_cluster;
+    int lidos = le_host(origem, bloco, n);
+    if (lidos <= 0) {
+      total = lidos < 0 ? -1 : total;
+      break;
+    }
+    int escritos = escreve_fim(arquivo, bloco, lidos);
+    total += escritos;
+    if (escritos < lidos || lidos < n) {
+      break;
+    }
+  }
+  buffer_devolve(bloco);
+  //as escritas seguintes no descritor voltam às reservas que crescem
+  if (arquivo->reservaExata) {
+    arquivo->reservaExata = 0;
+    arquivo->reservaTam = prealoca_min;
+  }
+  arquivo->posicao = tamanho_atual(arquivo);
+  return total;
+}
+
+/*
+ * Copia para o destino o arquivo aberto para leitura, da posição de
+ * fs_read até o fim. Cada trecho contíguo de clusters inteiros vai da
+ * imagem para o destino numa só bl_export; o pedaço inicial até o limite
+ * de um cluster e o final passam pelo caminho normal de leitura.
+ */
+long long exporta(arquivosAbertos *arquivo, int destino, int file) {
+  long long tamanho = dir[arquivo->dirIndex].size;
+  long long total = 0;
+  char *bloco = buffer_pega();
+
+  if (bloco == NULL) {
+    return -1;
+  }
+  long long inicial = (tam_cluster - arquivo->totalLido % tam_cluster) % tam_cluster;
+  if (inicial > tamanho - arquivo->totalLido) {
+    inicial = tamanho - arquivo->totalLido;
+  }
+  if (inicial > 0) {
+    if (le_arquivo(bloco, (int) inicial, file) != inicial || !escreve_host(destino, bloco, (int) inicial)) {
+      buffer_devolve(bloco);
+      return -1;
+    }
+    total += inicial;
+  }
+  while (tamanho - arquivo->totalLido >= tam_cluster) {
+    int logico = (int) (arquivo->totalLido / tam_cluster);
+    long long inteiros = (tamanho - arquivo->totalLido) / tam_cluster;
+    int maximo = inteiros < COPIA_TRECHO / tam_cluster ? (int) inteiros : COPIA_TRECHO / tam_cluster;
+    int cont = 1;
+    while (cont < maximo && arquivo->mapa[logico + cont] == arquivo->mapa[logico] + cont) {
+      cont++;
+    }
+    long c = bl_export(destino, arquivo->mapa[logico] * setores_cluster, cont * setores_cluster);
+    if (c != (long) cont * tam_cluster) {
+      buffer_devolve(bloco);
+      return -1;
+    }
+    posiciona_leitura(arquivo, arquivo->totalLido + c);
+    total += c;
+  }
+  // O que sobrou não completa um cluster
+  int final = (int) (tamanho - arquivo->totalLido);
+  if (final > 0) {
+    if (le_arquivo(bloco, final, file) != final || !escreve_host(destino, bloco, final)) {
+      total = -1;
+    } else {
+      total += final;
+    }
+  }
+  buffer_devolve(bloco);
+  return total;
+}
+
+long long fs_import(int fd, int file) {
+  long long inicio = traco_inicio();
+  long long copiados = -1;
+
+  trava_arquivo(file);
+  arquivosAbertos *arquivo = pega_arquivo(file);
+  if (arquivo != NULL && arquivo->categoria != FS_R && arquivo->ocupado) {
+    copiados = importa(arquivo, fd);
+    sincroniza(FS_SYNC_WRITE);
+  }
+  destrava_arquivo(file);
+  traco_fim(TR_IMPORT, inicio, NULL, 0, file, 0, 0, copiados);
+  return copiados;
+}
+
+long long fs_export(int file, int fd) {
+  long long inicio = traco_inicio();
+  long long copiados = -1;
+
+  trava_arquivo(file);
+  arquivosAbertos *arquivo = pega_arquivo(file);
+  if (arquivo != NULL && arquivo->categoria == FS_R && arquivo->ocupado) {
+    copiados = exporta(arquivo, fd, file);
+  }
+  destrava_arquivo(file);
+  traco_fim(TR_EXPORT, inicio, NULL, 0, file, 0, 0, copiados);
+  return copiados;
+}
+
+/* importação em massa: a lista de arquivos e o que as threads já fizeram */
+typedef struct {
+  char **caminhos;
+  char **nomes;
+  int n;
+  int proximo;  // próximo arquivo a pegar, com __atomic
+  int importados;
+  long long bytes;
+} importacao;
+
+/*
+ * Abre nome para escrita pelas entradas da API, que ficam no traço: cria o
+ * arquivo se ainda não existe ou o trunca, nunca as duas coisas.
+ */
+int abre_para_importar(char *nome) {
+  pthread_mutex_lock(&trava_dir);
+  int existe = dir_busca(nome) != -1;
+  pthread_mutex_unlock(&trava_dir);
+  //recém criado, o arquivo já está vazio: FS_A o abre sem removê-lo e criá-lo de novo
+  if (!existe && fs_create(nome)) {
+    return fs_open(nome, FS_A);
+  }
+  return fs_open(nome, FS_W);
+}
+
+void *importa_trabalhador(void *arg) {
+  importacao *imp = arg;
+  int adiado = sync_adiado;
+  int i;
+
+  sync_adiado = 1;
+
+  while ((i = __atomic_fetch_add(&imp->proximo, 1, __ATOMIC_RELAXED)) < imp->n) {
+    int origem = open(imp->caminhos[i], O_RDONLY);
+    if (origem == -1) {
+      perror(imp->caminhos[i]);
+      continue;
+    }
+    int file = abre_para_importar(imp->nomes[i]);
+    if (file != -1) {
+      long long copiados = fs_import(origem, file);
+      if (fs_close(file) == 0 && copiados >= 0) {
+        __atomic_add_fetch(&imp->importados, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&imp->bytes, copiados, __ATOMIC_RELAXED);
+      }
+    }
+    close(origem);
+  }
+  sync_adiado = adiado;
+  return NULL;
+}
+
+int fs_import_files(char **paths, char **names, int n, int threads, long long *bytes) {
+  pthread_t trabalhadores[IMPORTA_THREADS_MAX];
+  importacao imp = {paths, names, n, 0, 0, 0};
+  int criadas = 0;
+
+  *bytes = 0;
+  if (!verifica_formatacao()) {
+    return 0;
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+  if (threads > IMPORTA_THREADS_MAX) {
+    threads = IMPORTA_THREADS_MAX;
+  }
+  //os metadados de todos os arquivos vão para o diário numa transação só, no
+  //fim; só as threads da importação adiam, as outras seguem a política atual
+  while (criadas < threads - 1 && criadas < n - 1
+         && pthread_create(&trabalhadores[criadas], NULL, importa_trabalhador, &imp) == 0) {
+    criadas++;
+  }
+  importa_trabalhador(&imp);
+  for (int t = 0; t < criadas; t++) {
+    pthread_join(trabalhadores[t], NULL);
+  }
+  fs_sync();
+  *bytes = imp.bytes;
+  return imp.importados;
+}
+
+int fs_sync() {
+  long long inicio = traco_inicio();
+  //com todos os grupos travados nenhum arquivo está sendo usado
+  pthread_mutex_lock(&trava_dir);
+  trava_todos();
+  for (int i = 0; i < MAXOPENFILES; i++) {
+    if (descritores[i].ocupado && descritores[i].categoria != FS_R) {
+      descarrega(&descritores[i]);
+    }
+  }
+  pthread_mutex_lock(&trava_fat);
+  diario_grava();
+  pthread_mutex_unlock(&trava_fat);
+  int ok = bl_sync();
+  destrava_todos();
+  pthread_mutex_unlock(&trava_dir);
+  traco_fim(TR_SYNC, inicio, NULL, 0, -1, 0, 0, ok);
+  return ok;
+}
+
+int fs_trace_start(char *path) {
+  unsigned int cabecalho[2] = {TRACO_MAGICO, TRACO_VERSAO};
+
+  pthread_mutex_lock(&trava_traco);
+  if (traco != NULL) {
+    pthread_mutex_unlock(&trava_traco);
+    printf("Erro! O registro de chamadas já está ligado\n");
+    return 0;
+  }
+  if ((traco = fopen(path, "wb")) == NULL) {
+    pthread_mutex_unlock(&trava_traco);
+    perror("Abrindo o registro de chamadas");
+    return 0;
+  }
+  fwrite(cabecalho, sizeof(cabecalho), 1, traco);
+  traco_origem = relogio_ns();
+  __atomic_store_n(&traco_ativo, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&trava_traco);
+  return 1;
+}
+
+int fs_trace_stop() {
+  int ok = 1;
+
+  pthread_mutex_lock(&trava_traco);
+  __atomic_store_n(&traco_ativo, 0, __ATOMIC_RELAXED);
+  if (traco != NULL) {
+    ok = fclose(traco) == 0;
+    traco = NULL;
+  }
+  pthread_mutex_unlock(&trava_traco);
+  return ok;
+}
+
+/* descritor da reprodução que corresponde ao descritor registrado handle */
+int traco_descritor(int *descritores_reproducao, int handle) {
+  return handle >= 0 && handle < MAXOPENFILES ? descritores_reproducao[handle] : -1;
+}
+
+long fs_trace_replay(char *path, int paced, long *divergent) {
+  unsigned int cabecalho[2];
+  registro_traco r;
+  char nome[256];
+  int descritores_reproducao[MAXOPENFILES];
+  char *dados = NULL;
+  int dados_tam = 0;
+  long reproduzidas = 0;
+  FILE *f = fopen(path, "rb");
+
+  *divergent = 0;
+  if (f == NULL) {
+    perror("Abrindo o registro de chamadas");
+    return -1;
+  }
+  if (fread(cabecalho, sizeof(cabecalho), 1, f) != 1 || cabecalho[0] != TRACO_MAGICO
+      || cabecalho[1] != TRACO_VERSAO) {
+    printf("Erro! %s não é um registro de chamadas\n", path);
+    fclose(f);
+    return -1;
+  }
+  for (int i = 0; i < MAXOPENFILES; i++) {
+    descritores_reproducao[i] = -1;
+  }
+  long long origem = relogio_ns();
+  while (fread(&r, sizeof(r), 1, f) == 1) {
+    if (fread(nome, 1, r.nome_tam, f) != r.nome_tam) {
+      break;
+    }
+    nome[r.nome_tam] = '\0';
+
+    //leituras e escritas usam um buffer com um padrão qualquer, do maior tamanho pedido
+    int precisa = r.op == TR_IMPORT || r.op == TR_EXPORT ? COPIA_BUFFER : r.tam;
+    if (precisa > dados_tam) {
+      char *novo = realloc(dados, precisa);
+      if (novo == NULL) {
+        break;
+      }
+      dados = novo;
+      for (int i = dados_tam; i < precisa; i++) {
+        dados[i] = (char) (i * 31);
+      }
+      dados_tam = precisa;
+    }
+
+    //no ritmo do registro, cada chamada espera o seu instante de início
+    long long espera = paced ? r.inicio - (relogio_ns() - origem) : 0;
+    if (espera > 0) {
+      struct timespec ts = {espera / 1000000000LL, espera % 1000000000LL};
+      nanosleep(&ts, NULL);
+    }
+
+    int file = traco_descritor(descritores_reproducao, r.handle);
+    long long resultado = r.resultado;
+    switch (r.op) {
+    case FS_OP_OPEN:
+      resultado = fs_open(nome, r.arg);
+      if (r.resultado >= 0 && r.resultado < MAXOPENFILES) {
+        descritores_reproducao[r.resultado] = resultado;
+      }
+      //o número do descritor pode mudar, só importa se a abertura deu certo
+      if ((resultado == -1) == (r.resultado == -1)) {
+        resultado = r.resultado;
+      }
+      break;
+    case FS_OP_READ:
+      resultado = fs_read(dados, r.tam, file);
+      break;
+    case FS_OP_WRITE:
+      resultado = fs_write(dados, r.tam, file);
+      break;
+    case FS_OP_CLOSE:
+      resultado = fs_close(file);
+      if (r.handle >= 0 && r.handle < MAXOPENFILES) {
+        descritores_reproducao[r.handle] = -1;
+      }
+      break;
+    case FS_OP_CREATE:
+      resultado = fs_create(nome);
+      break;
+    case FS_OP_REMOVE:
+      resultado = fs_remove(nome);
+      break;
+    case TR_SEEK:
+      resultado = fs_seek(r.offset, r.arg, file);
+      break;
+    case TR_PREAD:
+      resultado = fs_pread(dados, r.tam, r.offset, file);
+      break;
+    case TR_PWRITE:
+      resultado = fs_pwrite(dados, r.tam, r.offset, file);
+      break;
+    case TR_SYNC:
+      resultado = fs_sync();
+      break;
+    case TR_FREE:
+      resultado = fs_free();
+      break;
+    case TR_LIST:
+      resultado = fs_list(dados, r.tam);
+      break;
+    case TR_FORMAT:
+      fs_cluster_size(r.tam);
+      resultado = fs_format();
+      break;
+    case TR_IMPORT:
+    case TR_EXPORT:
+      //o arquivo do host não está no registro: vira uma sequência de fs_write/fs_read
+      for (resultado = 0; resultado < r.resultado; ) {
+        int n = r.resultado - resultado < COPIA_BUFFER ? (int) (r.resultado - resultado) : COPIA_BUFFER;
+        int feito = r.op == TR_IMPORT ? fs_write(dados, n, file) : fs_read(dados, n, file);
+        if (feito <= 0) {
+          break;
+        }
+        resultado += feito;
+      }
+      break;
+    }
+    if (resultado != r.resultado) {
+      (*divergent)++;
+    }
+    reproduzidas++;
+  }
+  free(dados);
+  fclose(f);
+  return reproduzidas;
+}
+
+void fs_sync_policy(int policy) {
+  politica_sync = policy;
+}
+
+void fs_meta_stats(long *meta_sectors, long *user_bytes) {
+  pthread_mutex_lock(&trava_fat);
+  *meta_sectors = setores_meta_gravados;
+  pthread_mutex_unlock(&trava_fat);
+  *user_bytes = bytes_usuario_gravados;
+}
+
+void fs_alloc_stats(long *searches, long *words_scanned, long *longest, long *fat_loads) {
+  pthread_mutex_lock(&trava_fat);
+  *searches = buscas_livres;
+  *words_scanned = palavras_varridas;
+  *longest = maior_busca;
+  *fat_loads = setores_fat_buscados;
+  pthread_mutex_unlock(&trava_fat);
+}
+
+long fs_op_stats(int op, long buckets[FS_HIST_BUCKETS]) {
+  long total = 0;
+
+  if (op < 0 || op >= FS_OPS) {
+    return -1;
+  }
+  for (int b = 0; b < FS_HIST_BUCKETS; b++) {
+    buckets[b] = __atomic_load_n(&histograma[op][b], __ATOMIC_RELAXED);
+    total += buckets[b];
+  }
+  return total;
+}
+
+void fs_alloc_mode(int mode) {
+  modo_alocacao = mode;
+}
+
+void fs_write_buffer(int bytes) {
+  tamanho_acumulo = bytes;
+}
+
+void fs_readahead(int max_clusters) {
+  janela_maxima = max_clusters < RAMAX / 2 ? max_clusters : RAMAX / 2;
+}
+
+void fs_readahead_stats(long *prefetched, long *hits, long *wasted) {
+  *prefetched = ra_antecipados;
+  *hits = ra_acertos;
+  *wasted = ra_desperdicados;
+}
+
+int fs_cluster_size(int bytes) {
+  if (bytes < CLUSTERSIZE_MIN || bytes > CLUSTERSIZE_MAX || (bytes & (bytes - 1))) {
+    return 0;
+  }
+  tam_cluster_formatacao = bytes;
+  return 1;
 }
@@ -21,11 +21,44 @@
  */
 
 #define FS_R 0
-#define FS_W 1
+#define FS_W 1   /* trunca o arquivo */
+#define FS_A 2   /* escreve sempre no fim do arquivo */
+#define FS_RW 3  /* lê e altera o arquivo no lugar */
 
+/* origem do deslocamento em fs_seek */
+#define FS_SEEK_SET 0
+#define FS_SEEK_CUR 1
+#define FS_SEEK_END 2
+
+/* políticas de gravação dos metadados (FAT e diretório) sujos */
+#define FS_SYNC_WRITE 0   /* a cada fs_write, create, remove e close */
+#define FS_SYNC_CLOSE 1   /* em create, remove e close (padrão) */
+#define FS_SYNC_MANUAL 2  /* somente em fs_sync */
+
+/* modos de alocação de clusters para arquivos em escrita */
+#define FS_ALLOC_CLUSTER 0  /* um cluster livre por vez */
+#define FS_ALLOC_EXTENT 1   /* extensões contíguas pré-alocadas (padrão) */
+
+/* operações com histograma de latência em fs_op_stats */
+#define FS_OP_OPEN 0
+#define FS_OP_READ 1
+#define FS_OP_WRITE 2
+#define FS_OP_CLOSE 3
+#define FS_OP_CREATE 4
+#define FS_OP_REMOVE 5
+#define FS_OPS 6
+
+#define FS_HIST_BUCKETS 32  /* o balde b conta latências de 2^b a 2^(b+1) - 1 ns */
+#define FS_HIST_SAMPLE 16   /* fs_read/fs_write medem uma chamada em tantas por thread */
+
+/*
+ * As funções abaixo podem ser chamadas por várias threads ao mesmo tempo.
+ * Cada fs_open devolve um descritor próprio: um arquivo pode estar aberto
+ * por vários leitores ou por um único descritor de escrita.
+ */
 int fs_init();
 int fs_format();
-int fs_free();
+long long fs_free();
 int fs_list(char *buffer, int size);
 int fs_create(char *file_name);
 int fs_remove(char *file_name);
@@ -33,3 +66,66 @@ int fs_open(char *file_name, int mode);
 int fs_close(int file);
 int fs_write(char *buffer, int size, int file);
 int fs_read(char *buffer, int size, int file);
+long long fs_seek(long long offset, int whence, int file);
+int fs_pread(char *buffer, int size, long long offset, int file);
+int fs_pwrite(char *buffer, int size, long long offset, int file);
+
+/*
+ * Cópia entre um descritor do host e um arquivo aberto, sem os clusters
+ * inteiros passarem por buffers do processo. fs_import acrescenta ao fim
+ * de um arquivo aberto para escrita tudo o que resta em fd; fs_export
+ * grava em fd um arquivo aberto com FS_R, da posição de leitura até o
+ * fim. Devolvem quantos bytes foram copiados, -1 em erro.
+ */
+long long fs_import(int fd, int file);
+long long fs_export(int file, int fd);
+
+/*
+ * Importa n arquivos do host de uma vez, paths[i] para names[i] (criado se
+ * não existe, truncado se existe), com threads trabalhadoras lendo do host
+ * ao mesmo tempo. Cada arquivo recebe seus clusters numa reserva só, do
+ * tamanho da origem, e os dados vão da origem para a imagem em trechos
+ * grandes; os metadados são gravados uma vez, no fim, sem mudar a política
+ * de sincronização das outras threads. Devolve quantos arquivos foram
+ * importados, com o total de bytes em *bytes.
+ */
+int fs_import_files(char **paths, char **names, int n, int threads, long long *bytes);
+int fs_sync();
+void fs_sync_policy(int policy);
+void fs_meta_stats(long *meta_sectors, long *user_bytes);
+void fs_alloc_mode(int mode);
+
+/*
+ * Busca por clusters livres desde o início do processo: quantas buscas,
+ * palavras de 64 bits do mapa de livres examinadas no total e na busca
+ * mais longa, e setores da FAT lidos durante as buscas.
+ */
+void fs_alloc_stats(long *searches, long *words_scanned, long *longest, long *fat_loads);
+
+/*
+ * Copia o histograma de latência da operação op (FS_OP_*) para buckets e
+ * devolve quantas chamadas ele contém, -1 se op não existe.
+ */
+long fs_op_stats(int op, long buckets[FS_HIST_BUCKETS]);
+
+/*
+ * Registro das chamadas desta API num arquivo binário compacto: operação,
+ * nome, tamanhos, descritor, deslocamento, resultado, início e duração,
+ * sem os dados. fs_trace_replay refaz as chamadas de um registro na imagem
+ * atual, o mais rápido possível ou, com paced, no ritmo em que foram
+ * registradas; os dados escritos são um padrão qualquer. Devolve quantas
+ * chamadas refez, -1 em erro, e em *divergent quantas tiveram um
+ * resultado diferente do registrado.
+ */
+int fs_trace_start(char *path);
+int fs_trace_stop();
+long fs_trace_replay(char *path, int paced, long *divergent);
+void fs_write_buffer(int bytes);
+void fs_readahead(int max_clusters);
+void fs_readahead_stats(long *prefetched, long *hits, long *wasted);
+
+/*
+ * Tamanho do cluster usado pelo próximo fs_format, potência de 2 entre 4 KiB
+ * e 1 MiB (padrão 4 KiB). Devolve 0 se o tamanho não é aceito.
+ */
+int fs_cluster_size(int bytes);
@@ -20,135 +20,319 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "disk.h"
 #include "fs.h"
 
 #define MAX_STR 256
 #define MAX_ARG 32
-#define COPY_BUFFER_SIZE 10
+/* múltiplo de todos os tamanhos de cluster, para o copy ler e gravar clusters inteiros */
+#define COPY_BUFFER_SIZE (1024 * 1024)
+#define LIST_BUFFER_MAX (64 * 1024 * 1024)
+#define BULK_THREADS 8  /* threads padrão do bulk */
+#define PATH_MAX_BULK 4096
+#define MAX_RESUMO 32  /* comandos diferentes no resumo do modo em lote */
 
-void format();
+void format(char *cluster);
 void list();
 void create(char *file);
 void fremove(char *file);
 void copy(char *file1, char *file2);
 void copyf(char *file1, char *file2);
 void copyt(char *file1, char *file2);
+void bulk(char *origem, char *threads);
+void stats();
+void trace(char *registro);
+void replay(char *registro, int ritmo);
+double agora();
+
+/* executa uma linha de comando; devolve 0 se ela é "exit" */
+int executa(char *linha) {
+  char *args[MAX_ARG + 1];
+  char *token;
+  int i = 0;
+
+  token = strtok(linha, " ");
+  while (token != NULL && i < MAX_ARG) {
+    args[i] = token;
+    i++;
+    token = strtok(NULL, " ");
+  }
+  args[i] = NULL;
+
+  if (args[0] == NULL) {
+    return 1;
+  }
+
+  if (!strcmp(args[0], "exit")) {
+    return 0;
+  } else if (!strcmp(args[0], "format")) {
+    if (i <= 2) {
+      format(args[1]);
+    } else {
+      printf("Uso: format [cluster_bytes]\n");
+    }
+  } else if (!strcmp(args[0], "list")) {
+    list();
+  } else if (!strcmp(args[0], "create")) {
+    if (i == 2) {
+      create(args[1]);
+    } else {
+      printf("Uso: create <file>\n");
+    }
+  } else if (!strcmp(args[0], "remove")) {
+    if (i == 2) {
+      fremove(args[1]);
+    } else {
+      printf("Uso: remove <file>\n");
+    }
+  } else if (!strcmp(args[0], "copy")) {
+    if (i == 3) {
+      copy(args[1], args[2]);
+    } else {
+      printf("Uso: copy <file1> <file2>\n");
+    }
+  } else if (!strcmp(args[0], "copyf")) {
+    if (i == 3) {
+      copyf(args[1], args[2]);
+    } else {
+      printf("Uso: copyf <real_file> <file>\n");
+    }
+  } else if (!strcmp(args[0], "copyt")) {
+    if (i == 3) {
+      copyt(args[1], args[2]);
+    } else {
+      printf("Uso: copyt <file> <real_file>\n");
+    }
+  } else if (!strcmp(args[0], "bulk")) {
+    if (i == 2 || i == 3) {
+      bulk(args[1], args[2]);
+    } else {
+      printf("Uso: bulk <diretório|lista> [threads]\n");
+    }
+  } else if (!strcmp(args[0], "stats")) {
+    stats();
+  } else if (!strcmp(args[0], "trace")) {
+    if (i == 2) {
+      trace(args[1]);
+    } else {
+      printf("Uso: trace <registro>|off\n");
+    }
+  } else if (!strcmp(args[0], "replay")) {
+    if (i == 2 || (i == 3 && !strcmp(args[2], "ritmo"))) {
+      replay(args[1], i == 3);
+    } else {
+      printf("Uso: replay <registro> [ritmo]\n");
+    }
+  } else {
+    printf("Comando inválido\n");
+  }
+  return 1;
+}
+
+/* lê uma linha de stream sem o '\n'; devolve 0 no fim */
+int le_linha(FILE *stream, char *linha) {
+  int tam;
+
+  if (fgets(linha, MAX_STR, stream) == NULL) {
+    return 0;
+  }
+  tam = strlen(linha);
+  if (tam > 0 && linha[tam - 1] == '\n') {
+    linha[tam - 1] = '\0';
+  }
+  return 1;
+}
+
+/* tempo acumulado por comando no modo em lote */
+typedef struct {
+  char nome[16];
+  long n;
+  double total;
+  double maior;
+} resumo_comando;
+
+/*
+ * Modo em lote: executa os comandos de arquivo ("-" é a entrada padrão)
+ * sem prompt, mostrando o tempo de cada um. Os metadados só são gravados
+ * a cada sync_cada comandos (0: só no fim), e não a cada create, remove
+ * ou close. No fim mostra quantas vezes cada comando rodou e quanto tempo
+ * levou.
+ */
+int lote(char *arquivo, int sync_cada) {
+  FILE *stream = strcmp(arquivo, "-") ? fopen(arquivo, "r") : stdin;
+  resumo_comando resumo[MAX_RESUMO];
+  int nresumo = 0;
+  char linha[MAX_STR];
+  char nome[16];
+  long executados = 0;
+  double inicio_lote = agora();
+
+  if (stream == NULL) {
+    perror("Abrindo arquivo de comandos");
+    return 0;
+  }
+  fs_sync_policy(FS_SYNC_MANUAL);
+  while (le_linha(stream, linha)) {
+    if (sscanf(linha, "%15s", nome) != 1 || nome[0] == '#') {
+      continue;
+    }
+    double inicio = agora();
+    int continua = executa(linha);
+    executados++;
+    if (sync_cada > 0 && executados % sync_cada == 0) {
+      fs_sync();
+    }
+    double tempo = agora() - inicio;
+    printf("%10.3f ms  %s\n", tempo * 1000, nome);
+
+    int r;
+    for (r = 0; r < nresumo && strcmp(resumo[r].nome, nome); r++);
+    if (r == nresumo && nresumo < MAX_RESUMO) {
+      strcpy(resumo[nresumo].nome, nome);
+      resumo[nresumo].n = 0;
+      resumo[nresumo].total = resumo[nresumo].maior = 0;
+      nresumo++;
+    }
+    if (r < nresumo) {
+      resumo[r].n++;
+      resumo[r].total += tempo;
+      if (tempo > resumo[r].maior) {
+        resumo[r].maior = tempo;
+      }
+    }
+    if (!continua) {
+      break;
+    }
+  }
+  if (stream != stdin) {
+    fclose(stream);
+  }
+
+  double inicio_sync = agora();
+  int ok = fs_sync();
+  double tempo_sync = agora() - inicio_sync;
+  double total = agora() - inicio_lote;
+
+  printf("\n%-10s %8s %12s %12s %12s\n", "comando", "vezes", "total ms", "médio ms", "maior ms");
+  for (int r = 0; r < nresumo; r++) {
+    printf("%-10s %8ld %12.3f %12.3f %12.3f\n", resumo[r].nome, resumo[r].n, resumo[r].total * 1000,
+           resumo[r].total * 1000 / resumo[r].n, resumo[r].maior * 1000);
+  }
+  printf("%ld comandos em %.3f s (%.1f/s), sync final %.3f ms\n", executados, total,
+         total > 0 ? executados / total : 0, tempo_sync * 1000);
+  return ok;
+}
 
 int main(int argc, char **argv) {
   char *image;
+  char *comandos = NULL;
+  int sync_cada = 0;
   int size;
+  int backend;
   char linha[MAX_STR];
-  char *args[MAX_ARG + 1];
-  char *token;
-  int i, tam;
 
   size = -1;
-  if (argc >= 2 && argc <= 3) {
+  backend = BL_PREAD;
+  while (argc >= 2 && argv[1][0] == '-' && argv[1][1] != '\0') {
+    if (!strcmp(argv[1], "-m")) {
+      backend = BL_MMAP;
+    } else if (!strcmp(argv[1], "-b") && argc >= 3) {
+      comandos = argv[2];
+      argv++;
+      argc--;
+    } else if (!strcmp(argv[1], "-n") && argc >= 3) {
+      sync_cada = atoi(argv[2]);
+      argv++;
+      argc--;
+    } else {
+      break;
+    }
+    argv++;
+    argc--;
+  }
+  if (argc >= 2 && argc <= 3 && argv[1][0] != '-') {
     image = argv[1];
     if (argc > 2) {
-      size = (atoi(argv[2]) * 1024 * 1024) / SECTORSIZE;
+      size = (int) ((long) atoi(argv[2]) * 1024 * 1024 / SECTORSIZE);
     }
   } else {
-    printf("Uso: %s imagem [tamanho]\n", argv[0]);
+    printf("Uso: %s [-m] [-b comandos [-n N]] imagem [tamanho]\n", argv[0]);
     printf("Onde: imagem é o arquivo contendo a imagem do disco.\n");
     printf("      tamanho (opcional) é o tamanho da imagem em MB.\n");
+    printf("      -m acessa a imagem mapeada na memória (mmap).\n");
+    printf("      -b executa os comandos do arquivo (- para a entrada padrão), sem prompt.\n");
+    printf("      -n no modo em lote, grava os metadados a cada N comandos (padrão: só no fim).\n");
     exit(0);
   }
 
-  if (!bl_init(image, size)) {
+  if (!bl_init(image, size, backend)) {
     exit(0);
   }
-  printf("teste1\n");
-  puts(image);
-  printf("teste2\n");
-  printf("Arquivo de imagem %s aberto.\n", image);
-  printf("Tamanho %d setores (%d bytes).\n", bl_size(), bl_size() * SECTORSIZE);
-  
+  if (comandos == NULL) {
+    printf("Arquivo de imagem %s aberto.\n", image);
+    printf("Tamanho %d setores (%ld bytes).\n", bl_size(), (long) bl_size() * SECTORSIZE);
+  }
+
   if (!fs_init()) {
     exit(0);
   }
 
+  if (comandos != NULL) {
+    int ok = lote(comandos, sync_cada);
+    fs_trace_stop();
+    exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
   while (1) {
     printf("> ");
     linha[0] = '\0';
-    fgets(linha, MAX_STR, stdin);
-    tam = strlen(linha);
-    if (tam > 0 && linha[tam - 1] == '\n') {
-      linha[tam - 1] = '\0';
-    }
-
-    i = 0;
-    token = strtok(linha, " ");
-    while (token != NULL && i < MAX_ARG) {
-      args[i] = token;
-      i++;
-      token = strtok(NULL, " ");
-    }
-    args[i] = NULL;
-    
-    if (args[0] == NULL) {
-      continue;
-    }
-
-    if (!strcmp(args[0], "exit")) {
+    //no fim da entrada sai como com "exit"
+    if (!le_linha(stdin, linha) || !executa(linha)) {
+      fs_sync();
+      fs_trace_stop();
       exit(EXIT_SUCCESS);
-    } else if (!strcmp(args[0], "format")) {
-      format();
-    } else if (!strcmp(args[0], "list")) {
-      list();
-    } else if (!strcmp(args[0], "create")) {
-      if (i == 2) {
-	create(args[1]);
-      } else {
-	printf("Uso: create <file>\n");
-      }
-    } else if (!strcmp(args[0], "remove")) {
-      if (i == 2) {
-	fremove(args[1]);
-      } else {
-	printf("Uso: remove <file>\n");
-      }
-    } else if (!strcmp(args[0], "copy")) {
-      if (i == 3) {
-	copy(args[1], args[2]);
-      } else {
-	printf("Uso: copy <file1> <file2>\n");
-      }
-    } else if (!strcmp(args[0], "copyf")) {
-      if (i == 3) {
-	copyf(args[1], args[2]);
-      } else {
-	printf("Uso: copyf <real_file> <file>\n");
-      }
-    } else if (!strcmp(args[0], "copyt")) {
-      if (i == 3) {
-	copyt(args[1], args[2]);
-      } else {
-	printf("Uso: copyt <file> <real_file>\n");
-      }
-    } else {
-      printf("Comando inválido\n");
     }
   }
 }
 
-void format() {
+/* formata com o tamanho de cluster dado, ou com o da última formatação */
+void format(char *cluster) {
+  if (cluster != NULL && !fs_cluster_size(atoi(cluster))) {
+    printf("Tamanho de cluster inválido: potência de 2 entre 4096 e 1048576\n");
+    return;
+  }
   if (fs_format()) {
-    printf("Formatação concluída. %d bytes livres.\n", fs_free());
+    printf("Formatação concluída. %lld bytes livres.\n", fs_free());
   }
 }
 
 void list() {
-  char buffer[4096];
-  if (fs_list(buffer, 4096)) {
+  int tam = 4096;
+  int ok = 0;
+  char *buffer = malloc(tam);
+
+  //o diretório pode ter milhares de arquivos, dobra o buffer até caber
+  while (buffer != NULL && !(ok = fs_list(buffer, tam)) && tam < LIST_BUFFER_MAX) {
+    free(buffer);
+    tam *= 2;
+    buffer = malloc(tam);
+  }
+  if (!ok) {
+    printf("Erro. Buffer cheio!\n");
+  } else {
     printf("%s", buffer);
-    printf("%d bytes livres.\n", fs_free());
+    printf("%lld bytes livres.\n", fs_free());
   }
+  free(buffer);
 }
 
 void create(char *file) {
@@ -159,86 +343,295 @@ void fremove(char *file) {
   fs_remove(file);
 }
 
+double agora() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* mostra quantos bytes uma cópia transferiu e a vazão */
+void relata_copia(long long bytes, double inicio) {
+  double segundos = agora() - inicio;
+
+  printf("%lld bytes em %.3f s", bytes, segundos);
+  if (segundos > 0) {
+    printf(" (%.2f MB/s)", bytes / (1024.0 * 1024.0) / segundos);
+  }
+  printf("\n");
+}
+
 void copy(char *file1, char *file2) {
   int fd1, fd2;
-  char buffer[COPY_BUFFER_SIZE];
+  char *buffer;
   int read;
+  long long total = 0;
+  double inicio = agora();
 
+  if ((buffer = malloc(COPY_BUFFER_SIZE)) == NULL) {
+    return;
+  }
   if ((fd1 = fs_open(file1, FS_R)) == -1) {
+    free(buffer);
     return;
   }
 
   if ((fd2 = fs_open(file2, FS_W)) == -1) {
     fs_close(fd1);
+    free(buffer);
     return;
   }
   while ((read = fs_read(buffer, COPY_BUFFER_SIZE, fd1)) > 0) {
     if (fs_write(buffer, read, fd2) != read) {
-      fs_close(fd1);
-      fs_close(fd2);
-      return;
+      break;
     }
+    total += read;
   }
 
   fs_close(fd1);
   fs_close(fd2);
+  free(buffer);
+  relata_copia(total, inicio);
 }
 
 void copyf(char *file1, char *file2) {
-  int fd2;
-  char buffer[COPY_BUFFER_SIZE];
-  FILE *stream;
-  int read;
+  int fd1, fd2;
+  long long copiados;
+  double inicio = agora();
 
-  stream = fopen(file1, "r");
-  if (stream == NULL) {
+  if ((fd1 = open(file1, O_RDONLY)) == -1) {
     perror("Abrindo arquivo real para cópia (leitura)");
     return;
   }
 
   if ((fd2 = fs_open(file2, FS_W)) == -1) {
-    fclose(stream);
+    close(fd1);
     return;
   }
 
-  while ((read = fread(buffer, sizeof(char), COPY_BUFFER_SIZE, stream)) > 0) {
-    if (fs_write(buffer, read, fd2) != read) {
-      fclose(stream);
-      fs_close(fd2);
-      return;
-    }
-  }
-
-  fclose(stream);
+  copiados = fs_import(fd1, fd2);
+  close(fd1);
   fs_close(fd2);
+  if (copiados >= 0) {
+    relata_copia(copiados, inicio);
+  }
 }
 
 void copyt(char *file1, char *file2) {
-  int fd1;
-  char buffer[COPY_BUFFER_SIZE];
-  FILE *stream;
-  int read;
+  int fd1, fd2;
+  long long copiados;
+  double inicio = agora();
 
   if ((fd1 = fs_open(file1, FS_R)) == -1) {
     return;
   }
 
-  stream = fopen(file2, "w+");
-  if (stream == NULL) {
+  if ((fd2 = open(file2, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
     perror("Abrindo arquivo real para cópia (escrita)");
     fs_close(fd1);
     return;
   }
 
-  while ((read = fs_read(buffer, COPY_BUFFER_SIZE, fd1)) > 0) {
-    if (fwrite(buffer, sizeof(char), read, stream) != read) {
-      perror("Escrevendo arquivo real");
-      fs_close(fd1);
-      fclose(stream);
+  copiados = fs_export(fd1, fd2);
+  fs_close(fd1);
+  if (close(fd2) == -1) {
+    perror("Escrevendo arquivo real");
+    return;
+  }
+  if (copiados >= 0) {
+    relata_copia(copiados, inicio);
+  }
+}
+
+/* escreve a duração de ns nanossegundos na unidade mais legível */
+void mostra_duracao(long long ns) {
+  if (ns < 10000) {
+    printf("%8lldns", ns);
+  } else if (ns < 10000000) {
+    printf("%8lldus", ns / 1000);
+  } else if (ns < 10000000000LL) {
+    printf("%8lldms", ns / 1000000);
+  } else {
+    printf("%8llds ", ns / 1000000000);
+  }
+}
+
+/* limite superior, em ns, do balde onde cai o percentil p do histograma */
+long long percentil_histograma(long *baldes, long total, int p) {
+  long alvo = (total * p + 99) / 100;
+  long acumulado = 0;
+  int b;
+
+  for (b = 0; b < FS_HIST_BUCKETS - 1; b++) {
+    acumulado += baldes[b];
+    if (acumulado >= alvo) {
+      break;
+    }
+  }
+  return 1LL << (b + 1);
+}
+
+void stats() {
+  long setores, bytes;
+  long acertos, faltas, despejos;
+  long antecipados, desperdicados;
+  long lidos, gravados, chamadas, syncs;
+  long buscas, palavras, maior, fat;
+  long baldes[FS_HIST_BUCKETS];
+  char *nomes[FS_OPS] = {"fs_open", "fs_read", "fs_write", "fs_close", "fs_create", "fs_remove"};
+
+  bl_io_stats(&lidos, &gravados, &chamadas, &syncs);
+  printf("Disco: %ld setores lidos, %ld gravados, %ld chamadas ao sistema, "
+         "%ld sincronizações (fdatasync/msync)\n", lidos, gravados, chamadas, syncs);
+
+  fs_meta_stats(&setores, &bytes);
+  printf("Metadados: %ld setores (%ld bytes) gravados para %ld bytes de dados", setores,
+         setores * SECTORSIZE, bytes);
+  if (bytes > 0) {
+    printf(" (%.6f setores/byte)", (double) setores / bytes);
+  }
+  printf("\n");
+
+  fs_alloc_stats(&buscas, &palavras, &maior, &fat);
+  printf("Alocação: %ld buscas, %ld palavras do mapa varridas", buscas, palavras);
+  if (buscas > 0) {
+    printf(" (média %.1f, maior %ld)", (double) palavras / buscas, maior);
+  }
+  printf(", %ld setores da FAT lidos\n", fat);
+
+  bl_cache_stats(&acertos, &faltas, &despejos);
+  printf("Cache: %ld acertos, %ld faltas, %ld despejos\n", acertos, faltas, despejos);
+
+  fs_readahead_stats(&antecipados, &acertos, &desperdicados);
+  printf("Leitura antecipada: %ld clusters buscados, %ld acertos, %ld desperdiçados\n",
+         antecipados, acertos, desperdicados);
+
+  printf("Latência (fs_read/fs_write: 1 em %d chamadas)\n", FS_HIST_SAMPLE);
+  printf("%-10s %10s %10s %10s %10s %10s\n", "operação", "medidas", "p50 <", "p90 <", "p99 <", "máx <");
+  for (int op = 0; op < FS_OPS; op++) {
+    long total = fs_op_stats(op, baldes);
+    if (total <= 0) {
+      continue;
+    }
+    printf("%-10s %10ld ", nomes[op], total);
+    mostra_duracao(percentil_histograma(baldes, total, 50));
+    printf(" ");
+    mostra_duracao(percentil_histograma(baldes, total, 90));
+    printf(" ");
+    mostra_duracao(percentil_histograma(baldes, total, 99));
+    printf(" ");
+    mostra_duracao(percentil_histograma(baldes, total, 100));
+    printf("\n");
+  }
+}
+
+/* liga o registro das chamadas em registro, ou desliga com "off" */
+void trace(char *registro) {
+  if (!strcmp(registro, "off")) {
+    fs_trace_stop();
+  } else if (fs_trace_start(registro)) {
+    printf("Registrando as chamadas em %s\n", registro);
+  }
+}
+
+void replay(char *registro, int ritmo) {
+  long divergentes;
+  double inicio = agora();
+  long n = fs_trace_replay(registro, ritmo, &divergentes);
+  double segundos = agora() - inicio;
+
+  if (n >= 0) {
+    printf("%ld chamadas refeitas em %.3f s", n, segundos);
+    if (segundos > 0) {
+      printf(" (%.0f/s)", n / segundos);
+    }
+    printf(", %ld com resultado diferente do registrado\n", divergentes);
+  }
+}
+
+/* acrescenta à lista do bulk o arquivo caminho, que vira o arquivo nome na imagem */
+int bulk_acrescenta(char ***caminhos, char ***nomes, int *n, int *cap, char *caminho, char *nome) {
+  if (*n == *cap) {
+    int novo = *cap ? *cap * 2 : 256;
+    char **c = realloc(*caminhos, sizeof(char *) * novo);
+    if (c != NULL) {
+      *caminhos = c;
+    }
+    char **m = realloc(*nomes, sizeof(char *) * novo);
+    if (m != NULL) {
+      *nomes = m;
+    }
+    if (c == NULL || m == NULL) {
+      return 0;
+    }
+    *cap = novo;
+  }
+  (*caminhos)[*n] = strdup(caminho);
+  (*nomes)[*n] = strdup(nome);
+  (*n)++;
+  return 1;
+}
+
+/*
+ * Importa de uma vez os arquivos regulares de um diretório do host, com o
+ * mesmo nome, ou os de uma lista com uma linha "caminho [nome]" por
+ * arquivo (o nome padrão é o do arquivo no host).
+ */
+void bulk(char *origem, char *threads) {
+  char **caminhos = NULL, **nomes = NULL;
+  int n = 0, cap = 0;
+  char caminho[PATH_MAX_BULK], linha[PATH_MAX_BULK];
+  struct stat st;
+  double inicio = agora();
+
+  if (stat(origem, &st) == -1) {
+    perror(origem);
+    return;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    DIR *d = opendir(origem);
+    struct dirent *e;
+    if (d == NULL) {
+      perror(origem);
       return;
     }
+    while ((e = readdir(d)) != NULL) {
+      snprintf(caminho, sizeof(caminho), "%s/%s", origem, e->d_name);
+      if (stat(caminho, &st) == 0 && S_ISREG(st.st_mode)
+          && !bulk_acrescenta(&caminhos, &nomes, &n, &cap, caminho, e->d_name)) {
+        break;
+      }
+    }
+    closedir(d);
+  } else {
+    FILE *lista = fopen(origem, "r");
+    if (lista == NULL) {
+      perror(origem);
+      return;
+    }
+    while (fgets(linha, sizeof(linha), lista) != NULL) {
+      char nome[PATH_MAX_BULK];
+      int campos = sscanf(linha, "%s %s", caminho, nome);
+      if (campos < 1 || caminho[0] == '#') {
+        continue;
+      }
+      char *base = strrchr(caminho, '/');
+      if (!bulk_acrescenta(&caminhos, &nomes, &n, &cap, caminho,
+                           campos == 2 ? nome : base != NULL ? base + 1 : caminho)) {
+        break;
+      }
+    }
+    fclose(lista);
   }
 
-  fs_close(fd1);
-  fclose(stream);
+  long long bytes;
+  int importados = fs_import_files(caminhos, nomes, n, threads != NULL ? atoi(threads) : BULK_THREADS, &bytes);
+  printf("%d de %d arquivos importados, ", importados, n);
+  relata_copia(bytes, inicio);
+  for (int i = 0; i < n; i++) {
+    free(caminhos[i]);
+    free(nomes[i]);
+  }
+  free(caminhos);
+  free(nomes);
 }